@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+#
+# as_server.py: Local stand-in for the Audioscrobbler web service.
+#
+# ==================================================================
+# Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+# Based on Jonathan Coome's work on scmpc
+#
+# This file is part of scmpc.
+#
+# scmpc is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# scmpc is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with scmpc; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+# ==================================================================
+#
+# Answers auth.getMobileSession, track.updateNowPlaying and track.scrobble
+# the way Last.fm does, checking api_sig and the session key. Latency,
+# error responses, ignored scrobbles and dropped connections can be
+# injected. Point an audioscrobbler section at it with
+#
+#   url = "http://127.0.0.1:<port>/2.0/"
+#
+# Run it on its own, or import it as drain.py does.
+
+import argparse
+import hashlib
+import json
+import random
+import re
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlsplit
+
+# scmpc's own API account, used when a section doesn't set one
+API_SECRET = "365e18391ccdee3bf820cb3d2ba466f6"
+
+SESSION_KEY = "d580d57f32848f5dcf574d1ce18d78b2"
+
+ERROR_MESSAGES = {
+    4: "Authentication Failed",
+    9: "Invalid session key - Please re-authenticate",
+    11: "Service Offline - This service is temporarily offline",
+    13: "Invalid method signature supplied",
+    16: "There was a temporary error processing your request",
+    29: "Rate Limit Exceeded",
+}
+
+ITEM = re.compile(r"^(\w+)\[(\d+)\]$")
+
+
+class Options:
+    """What to inject, all rates are between 0 and 1"""
+
+    def __init__(self, **kwargs):
+        self.latency = 0.0
+        self.jitter = 0.0
+        self.error_rate = 0.0
+        self.error_code = 16
+        self.ignore_rate = 0.0
+        self.ignore_code = 1
+        self.drop_rate = 0.0
+        self.secret = API_SECRET
+        self.seed = None
+        self.__dict__.update(kwargs)
+
+
+class Stats:
+    """Everything the server saw, shared by the handler threads"""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.requests = {}
+        self.errors = 0
+        self.dropped = 0
+        self.scrobbles = 0
+        # timestamp of every song that is done, accepted or ignored for
+        # good, and when it was done
+        self.done = {}
+        self.first_scrobble = None
+        self.changed = threading.Condition(self.lock)
+
+    def count(self, method):
+        self.requests[method] = self.requests.get(method, 0) + 1
+
+    def summary(self):
+        with self.lock:
+            return {
+                "requests": dict(self.requests),
+                "errors": self.errors,
+                "dropped": self.dropped,
+                "scrobbles": self.scrobbles,
+                "done": len(self.done),
+            }
+
+
+def signature(params, secret):
+    """api_sig as Last.fm computes it"""
+    data = "".join(name + params[name] for name in sorted(params)
+                   if name not in ("api_sig", "format", "callback"))
+    return hashlib.md5((data + secret).encode("utf-8")).hexdigest()
+
+
+def lfm(body, status="ok"):
+    return ('<?xml version="1.0" encoding="utf-8"?>\n'
+            '<lfm status="%s">\n%s</lfm>\n' % (status, body))
+
+
+def lfm_error(code):
+    return lfm('<error code="%d">%s</error>\n' %
+               (code, ERROR_MESSAGES.get(code, "Error")), "failed")
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_GET(self):
+        self.api(urlsplit(self.path).query)
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        self.api(self.rfile.read(length).decode("utf-8"))
+
+    def api(self, query):
+        server = self.server
+        opts, stats = server.options, server.stats
+        params = {k: v[0] for k, v in
+                  parse_qs(query, keep_blank_values=True).items()}
+        method = params.get("method", "")
+
+        with stats.lock:
+            stats.count(method)
+            roll = server.random.random()
+            delay = opts.latency + server.random.uniform(0, opts.jitter)
+
+        if delay > 0:
+            time.sleep(delay)
+
+        if roll < opts.drop_rate:
+            with stats.lock:
+                stats.dropped += 1
+            self.close_connection = True
+            return
+        roll -= opts.drop_rate
+
+        if roll < opts.error_rate:
+            with stats.lock:
+                stats.errors += 1
+            return self.reply(lfm_error(opts.error_code))
+
+        if params.get("api_sig") != signature(params, opts.secret):
+            return self.reply(lfm_error(13))
+
+        if method == "auth.getMobileSession":
+            return self.reply(lfm(
+                "<session><name>%s</name><key>%s</key>"
+                "<subscriber>0</subscriber></session>\n" %
+                (params.get("username", ""), SESSION_KEY)))
+        if params.get("sk") != SESSION_KEY:
+            return self.reply(lfm_error(9))
+        if method == "track.updateNowPlaying":
+            return self.reply(lfm(
+                "<nowplaying><track corrected=\"0\"></track>"
+                "<ignoredMessage code=\"0\"></ignoredMessage>"
+                "</nowplaying>\n"))
+        if method == "track.scrobble":
+            return self.reply(self.scrobble(params))
+        return self.reply(lfm_error(3))
+
+    def scrobble(self, params):
+        server = self.server
+        opts, stats = server.options, server.stats
+        songs = {}
+
+        for name, value in params.items():
+            m = ITEM.match(name)
+            if m:
+                songs.setdefault(int(m.group(2)), {})[m.group(1)] = value
+        if not songs and "timestamp" in params:
+            songs[0] = params
+
+        body, accepted = [], 0
+        now = time.monotonic()
+        with stats.lock:
+            if stats.first_scrobble is None:
+                stats.first_scrobble = now
+            for i in sorted(songs):
+                code = 0
+                if server.random.random() < opts.ignore_rate:
+                    code = opts.ignore_code
+                else:
+                    accepted += 1
+                stats.scrobbles += 1
+                # the daily limit is the only reason scmpc sends it again
+                if code != 5:
+                    stats.done.setdefault(songs[i].get("timestamp"), now)
+                body.append(
+                    "<scrobble><timestamp>%s</timestamp>"
+                    "<ignoredMessage code=\"%d\"></ignoredMessage>"
+                    "</scrobble>\n" % (songs[i].get("timestamp", ""), code))
+            stats.changed.notify_all()
+
+        return lfm('<scrobbles accepted="%d" ignored="%d">\n%s</scrobbles>\n'
+                   % (accepted, len(songs) - accepted, "".join(body)))
+
+    def reply(self, body):
+        data = body.encode("utf-8")
+        self.send_response(200)
+        self.send_header("Content-Type", "text/xml; charset=utf-8")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, port=0, options=None):
+        super().__init__(("127.0.0.1", port), Handler)
+        self.options = options or Options()
+        self.stats = Stats()
+        self.random = random.Random(self.options.seed)
+
+    @property
+    def url(self):
+        return "http://127.0.0.1:%d/2.0/" % self.server_address[1]
+
+    def start(self):
+        thread = threading.Thread(target=self.serve_forever, daemon=True)
+        thread.start()
+        return thread
+
+
+def add_arguments(parser):
+    """Options shared with the harnesses"""
+    parser.add_argument("--latency", type=float, default=0.0,
+                        help="seconds before every response")
+    parser.add_argument("--jitter", type=float, default=0.0,
+                        help="up to this many more seconds, at random")
+    parser.add_argument("--error-rate", type=float, default=0.0,
+                        help="share of requests failing with --error-code")
+    parser.add_argument("--error-code", type=int, default=16,
+                        help="Last.fm error code, 16 is a temporary error")
+    parser.add_argument("--ignore-rate", type=float, default=0.0,
+                        help="share of scrobbles ignored with --ignore-code")
+    parser.add_argument("--ignore-code", type=int, default=1,
+                        help="ignoredMessage code, 5 is the daily limit")
+    parser.add_argument("--drop-rate", type=float, default=0.0,
+                        help="share of connections closed without a reply")
+    parser.add_argument("--secret", default=API_SECRET,
+                        help="API secret to check signatures with")
+    parser.add_argument("--seed", type=int, help="random seed")
+
+
+def options_from(args):
+    return Options(latency=args.latency, jitter=args.jitter,
+                   error_rate=args.error_rate, error_code=args.error_code,
+                   ignore_rate=args.ignore_rate, ignore_code=args.ignore_code,
+                   drop_rate=args.drop_rate, secret=args.secret,
+                   seed=args.seed)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Local stand-in for the Audioscrobbler web service")
+    parser.add_argument("--port", type=int, default=0,
+                        help="port to listen on, any free one by default")
+    add_arguments(parser)
+    args = parser.parse_args()
+
+    server = Server(args.port, options_from(args))
+    print(server.url, flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(json.dumps(server.stats.summary()), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+#
+# drain.py: Measure how fast scmpc drains a backlog into as_server.py.
+#
+# ==================================================================
+# Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+# Based on Jonathan Coome's work on scmpc
+#
+# This file is part of scmpc.
+#
+# scmpc is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# scmpc is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with scmpc; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+# ==================================================================
+#
+# Writes a journal with a synthetic backlog, starts scmpc in the foreground
+# against the stub server and waits until every song is scrobbled. The
+# result is a single JSON object on stdout, in the format of scmpc_bench:
+# throughput once the first submission arrived, and the latency of every
+# song from the start of scmpc to its scrobble.
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+import as_server
+
+JOURNAL_HEADER = "# scmpc journal 1\n"
+
+# timestamps of the synthetic songs start here
+FIRST_DATE = 1700000000
+
+
+def write_journal(filename, songs):
+    with open(filename, "w") as journal:
+        journal.write(JOURNAL_HEADER)
+        for i in range(songs):
+            journal.write("+ %d %d %d %d Artist %d\tTitle %d\tAlbum %d\n" %
+                          (i + 1, FIRST_DATE + i, 180 + i % 120, i % 20 + 1,
+                           i % 300, i, i % 1000))
+
+
+def write_config(filename, tmpdir, args, url):
+    with open(filename, "w") as config:
+        config.write("""log_level = %s
+pid_file = "%s"
+cache_file = "%s"
+queue_length = %d
+
+mpd {
+	host = "127.0.0.1"
+	port = %d
+}
+
+audioscrobbler {
+	url = "%s"
+	username = "bench"
+	password = "bench"
+	drain_requests = %d
+	submit_batch = %d
+}
+""" % (args.log_level, os.path.join(tmpdir, "scmpc.pid"),
+       os.path.join(tmpdir, "scmpc.cache"),
+       args.songs, args.mpd_port, url, args.drain_requests,
+       args.submit_batch))
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure how fast scmpc drains a backlog")
+    parser.add_argument("--scmpc", default="./scmpc",
+                        help="scmpc binary to run")
+    parser.add_argument("--songs", type=int, default=10000,
+                        help="songs in the backlog")
+    parser.add_argument("--drain-requests", type=int, default=2,
+                        help="drain_requests of the audioscrobbler section")
+    parser.add_argument("--submit-batch", type=int, default=10,
+                        help="submit_batch of the audioscrobbler section")
+    parser.add_argument("--mpd-port", type=int, default=9,
+                        help="MPD port, nothing needs to listen there")
+    parser.add_argument("--log-level", default="info",
+                        help="log_level of scmpc")
+    parser.add_argument("--timeout", type=float, default=300,
+                        help="give up after this many seconds")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the temporary directory and log")
+    as_server.add_arguments(parser)
+    args = parser.parse_args()
+
+    tmpdir = tempfile.mkdtemp(prefix="scmpc-drain-")
+    server = as_server.Server(0, as_server.options_from(args))
+    server.start()
+
+    config = os.path.join(tmpdir, "scmpc.conf")
+    write_config(config, tmpdir, args, server.url)
+    write_journal(os.path.join(tmpdir, "scmpc.cache.journal"), args.songs)
+
+    stats = server.stats
+    start = time.monotonic()
+    # in the foreground scmpc logs to stdout
+    log = open(os.path.join(tmpdir, "scmpc.log"), "w")
+    scmpc = subprocess.Popen([args.scmpc, "-n", "-f", config], stdout=log)
+    deadline = start + args.timeout
+    with stats.lock:
+        while len(stats.done) < args.songs and scmpc.poll() is None:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                break
+            stats.changed.wait(min(remaining, 1.0))
+        done = dict(stats.done)
+        first = stats.first_scrobble
+
+    if scmpc.poll() is None:
+        scmpc.send_signal(signal.SIGTERM)
+        try:
+            scmpc.wait(10)
+        except subprocess.TimeoutExpired:
+            scmpc.kill()
+            scmpc.wait()
+    server.shutdown()
+    log.close()
+
+    latencies = sorted(t - start for t in done.values())
+    last = max(done.values()) if done else None
+    result = {
+        "name": "drain",
+        "n": args.songs,
+        "completed": len(done),
+        "seconds": round(last - start, 3) if last else None,
+        "scrobbles_per_s": (round(len(done) / (last - first), 1)
+                            if last and last > first else None),
+        "latency_p50_s": percentile(latencies, 0.5),
+        "latency_p99_s": percentile(latencies, 0.99),
+        "latency_max_s": latencies[-1] if latencies else None,
+        "server": stats.summary(),
+        "exit_status": scmpc.returncode,
+    }
+    for key in ("latency_p50_s", "latency_p99_s", "latency_max_s"):
+        if result[key] is not None:
+            result[key] = round(result[key], 3)
+    print(json.dumps(result))
+
+    if args.keep:
+        print("Kept %s" % tmpdir, file=sys.stderr)
+    else:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return 0 if len(done) == args.songs else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
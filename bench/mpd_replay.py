@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# mpd_replay.py: Measure how scmpc handles a replayed MPD trace.
+#
+# ==================================================================
+# Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+# Based on Jonathan Coome's work on scmpc
+#
+# This file is part of scmpc.
+#
+# scmpc is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# scmpc is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with scmpc; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+# ==================================================================
+#
+# Starts scmpc against mpd_server.py and as_server.py and replays a trace.
+# The result is a single JSON object on stdout, in the format of
+# scmpc_bench: the latency from "changed: player" until scmpc idles again
+# and the commands it sent in between, for every event.
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+import as_server
+import drain
+import mpd_server
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure how scmpc handles a replayed MPD trace")
+    parser.add_argument("--scmpc", default="./scmpc",
+                        help="scmpc binary to run")
+    parser.add_argument("--trace", help="trace file to replay")
+    parser.add_argument("--scenario", choices=mpd_server.SCENARIOS,
+                        default="mixed",
+                        help="built-in trace to replay without --trace")
+    parser.add_argument("--speed", type=float, default=10.0,
+                        help="replay this many times faster")
+    parser.add_argument("--log-level", default="info",
+                        help="log_level of scmpc")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the temporary directory and log")
+    args = parser.parse_args()
+
+    if args.trace:
+        trace = mpd_server.load_trace(args.trace)
+        name = os.path.basename(args.trace)
+    else:
+        trace = mpd_server.scenario(args.scenario)
+        name = args.scenario
+
+    tmpdir = tempfile.mkdtemp(prefix="scmpc-replay-")
+    mpd = mpd_server.Server()
+    mpd.start()
+    scrobbler = as_server.Server()
+    scrobbler.start()
+
+    config = os.path.join(tmpdir, "scmpc.conf")
+    settings = argparse.Namespace(log_level=args.log_level, songs=500,
+                                  mpd_port=mpd.port, drain_requests=2,
+                                  submit_batch=10)
+    drain.write_config(config, tmpdir, settings, scrobbler.url)
+
+    log = open(os.path.join(tmpdir, "scmpc.log"), "w")
+    scmpc = subprocess.Popen([args.scmpc, "-n", "-f", config], stdout=log)
+    try:
+        if not mpd.wait_idle(30):
+            print("scmpc did not connect to the fake MPD", file=sys.stderr)
+            return 1
+        mpd.replay(trace, args.speed)
+        # give the last event time to be handled
+        time.sleep(1)
+    finally:
+        if scmpc.poll() is None:
+            scmpc.send_signal(signal.SIGTERM)
+            try:
+                scmpc.wait(10)
+            except subprocess.TimeoutExpired:
+                scmpc.kill()
+                scmpc.wait()
+        mpd.close()
+        scrobbler.shutdown()
+        log.close()
+
+    with mpd.lock:
+        handled = list(mpd.handled)
+    latencies = sorted(latency * 1000 for latency, _ in handled)
+    round_trips = sum(trips for _, trips in handled)
+    result = {
+        "name": "mpd_replay",
+        "trace": name,
+        "speed": args.speed,
+        "events": mpd.events,
+        "handled": len(handled),
+        "latency_p50_ms": drain.percentile(latencies, 0.5),
+        "latency_p99_ms": drain.percentile(latencies, 0.99),
+        "latency_max_ms": latencies[-1] if latencies else None,
+        "round_trips": round_trips,
+        "round_trips_per_event": (round(round_trips / len(handled), 2)
+                                  if handled else None),
+        "connections": mpd.connections,
+        "reconnect_s": [round(t, 3) for t in mpd.reconnects],
+        "scrobbler": scrobbler.stats.summary(),
+        "exit_status": scmpc.returncode,
+    }
+    for key in ("latency_p50_ms", "latency_p99_ms", "latency_max_ms"):
+        if result[key] is not None:
+            result[key] = round(result[key], 3)
+    print(json.dumps(result))
+
+    if args.keep:
+        print("Kept %s" % tmpdir, file=sys.stderr)
+    else:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,416 @@
+#!/usr/bin/env python3
+#
+# mpd_server.py: Fake MPD server that replays recorded player traces.
+#
+# ==================================================================
+# Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+# Based on Jonathan Coome's work on scmpc
+#
+# This file is part of scmpc.
+#
+# scmpc is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# scmpc is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with scmpc; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+# ==================================================================
+#
+# Speaks enough of the MPD protocol for scmpc: status, currentsong, idle,
+# noidle, password, ping and command lists. A trace is a file with one
+# JSON object per line, each one a player event at t seconds:
+#
+#   {"t": 0, "state": "play", "elapsed": 0,
+#    "song": {"file": "a.ogg", "Artist": "A", "Title": "T", "Time": 200}}
+#   {"t": 4.5, "state": "pause"}
+#   {"t": 6, "state": "play", "elapsed": 150}
+#   {"t": 9, "disconnect": true}
+#
+# Every key is optional: song replaces the current song, elapsed seeks
+# and disconnect drops all clients. Every event sends "changed: player" to
+# idling clients, and the time until they go back to idle is recorded as
+# the latency of the event, along with the commands they sent meanwhile.
+#
+# --record HOST[:PORT] writes such a trace from a real MPD instead.
+
+import argparse
+import json
+import socket
+import sys
+import threading
+import time
+
+VERSION = "0.21.0"
+
+SCENARIOS = ("skip-storm", "pause-resume", "seeks", "disconnects", "mixed")
+
+
+def song(n, duration=200):
+    return {"file": "bench/%d.ogg" % n, "Artist": "Artist %d" % (n % 30),
+            "Title": "Title %d" % n, "Album": "Album %d" % (n % 100),
+            "Track": str(n % 20 + 1), "Time": duration}
+
+
+def scenario(name, events=50):
+    """Synthetic traces of the situations that stress the event path"""
+    trace = [{"t": 0.0, "state": "play", "elapsed": 0, "song": song(0)}]
+    t = 1.0
+
+    if name in ("skip-storm", "mixed"):
+        for n in range(1, events + 1):
+            trace.append({"t": t, "state": "play", "elapsed": 0,
+                          "song": song(n)})
+            t += 0.2
+    if name in ("pause-resume", "mixed"):
+        for _ in range(events // 2):
+            trace.append({"t": t, "state": "pause"})
+            trace.append({"t": t + 0.5, "state": "play"})
+            t += 1.0
+    if name in ("seeks", "mixed"):
+        for n in range(events):
+            trace.append({"t": t, "state": "play",
+                          "elapsed": (n * 37) % 190})
+            t += 0.3
+    if name in ("disconnects", "mixed"):
+        # the replay pauses until scmpc is back
+        for n in range(2):
+            trace.append({"t": t, "disconnect": True})
+            trace.append({"t": t + 1, "state": "play", "elapsed": 0,
+                          "song": song(1000 + n)})
+            t += 2
+    return trace
+
+
+def load_trace(filename):
+    with open(filename) as f:
+        return [json.loads(line) for line in f if line.strip()]
+
+
+class Player:
+    """The state a trace drives"""
+
+    def __init__(self):
+        self.state = "stop"
+        self.song = None
+        self.song_id = 0
+        self.elapsed = 0.0
+        self.started = time.monotonic()
+
+    def apply(self, event):
+        if "song" in event and event["song"] != self.song:
+            self.song = event["song"]
+            self.song_id += 1
+            self.elapsed = 0.0
+            self.started = time.monotonic()
+        if "elapsed" in event:
+            self.elapsed = float(event["elapsed"])
+            self.started = time.monotonic()
+        if "state" in event and event["state"] != self.state:
+            # keep the position when pausing
+            self.elapsed = self.position()
+            self.started = time.monotonic()
+            self.state = event["state"]
+
+    def position(self):
+        if self.state != "play":
+            return self.elapsed
+        return self.elapsed + time.monotonic() - self.started
+
+    def status(self):
+        lines = ["volume: 100", "repeat: 0", "random: 0", "single: 0",
+                 "consume: 0", "playlist: %d" % (self.song_id + 1),
+                 "playlistlength: %d" % (1 if self.song else 0),
+                 "state: %s" % self.state]
+        if self.song and self.state != "stop":
+            duration = int(self.song.get("Time", 0))
+            elapsed = self.position()
+            lines += ["song: 0", "songid: %d" % self.song_id,
+                      "time: %d:%d" % (elapsed, duration),
+                      "elapsed: %.3f" % elapsed,
+                      "duration: %.3f" % duration,
+                      "bitrate: 320", "audio: 44100:24:2"]
+        return lines
+
+    def current_song(self):
+        if not self.song:
+            return []
+        lines = ["%s: %s" % (k, v) for k, v in self.song.items()]
+        lines += ["Pos: 0", "Id: %d" % self.song_id]
+        return lines
+
+
+class Client:
+    """One connection, served by its own thread"""
+
+    def __init__(self, server, sock):
+        self.server = server
+        self.sock = sock
+        self.lock = threading.Lock()
+        self.idle = False
+        # event being handled: when it was sent and the commands since
+        self.pending = None
+
+    def send(self, lines):
+        data = "".join(line + "\n" for line in lines).encode("utf-8")
+        with self.lock:
+            try:
+                self.sock.sendall(data)
+            except OSError:
+                pass
+
+    def notify(self, now):
+        """Called with the server lock held"""
+        if self.idle:
+            self.idle = False
+            self.pending = [now, 0]
+            self.send(["changed: player", "OK"])
+
+    def serve(self):
+        self.send(["OK MPD %s" % VERSION])
+        reader = self.sock.makefile("r", encoding="utf-8", newline="\n")
+        in_list, list_ok, queued = False, False, []
+        try:
+            for line in reader:
+                command = line.rstrip("\n").split(" ", 1)
+                name = command[0]
+                if name in ("command_list_begin", "command_list_ok_begin"):
+                    in_list, queued = True, []
+                    list_ok = name == "command_list_ok_begin"
+                    continue
+                if in_list and name != "command_list_end":
+                    queued.append(name)
+                    continue
+                if name == "command_list_end":
+                    in_list = False
+                    out = []
+                    for queued_name in queued:
+                        out += self.run(queued_name)
+                        if list_ok:
+                            out.append("list_OK")
+                    self.send(out + ["OK"])
+                    continue
+                if name == "close":
+                    break
+                if name == "idle":
+                    self.enter_idle()
+                    continue
+                if name == "noidle":
+                    with self.server.lock:
+                        was_idle, self.idle = self.idle, False
+                    if was_idle:
+                        self.send(["OK"])
+                    continue
+                self.send(self.run(name) + ["OK"])
+        except (OSError, ValueError):
+            pass
+        finally:
+            self.server.remove(self)
+
+    def run(self, name):
+        server = self.server
+        with server.lock:
+            if self.pending:
+                self.pending[1] += 1
+            server.commands += 1
+            if name == "status":
+                return server.player.status()
+            if name == "currentsong":
+                return server.player.current_song()
+        # password, ping and everything else just succeed
+        return []
+
+    def enter_idle(self):
+        server = self.server
+        with server.lock:
+            if self.pending:
+                sent, round_trips = self.pending
+                server.handled.append((time.monotonic() - sent, round_trips))
+                self.pending = None
+            self.idle = True
+            server.changed.notify_all()
+
+    def close(self):
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+        self.sock.close()
+
+
+class Server:
+    def __init__(self, port=0):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", port))
+        self.listener.listen(8)
+        self.port = self.listener.getsockname()[1]
+        self.lock = threading.Lock()
+        self.changed = threading.Condition(self.lock)
+        self.player = Player()
+        self.clients = []
+        self.connections = 0
+        self.commands = 0
+        self.events = 0
+        # (latency in seconds, round trips) of every handled event
+        self.handled = []
+        # seconds until a client was back after each disconnect
+        self.reconnects = []
+
+    def start(self):
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            try:
+                sock, _ = self.listener.accept()
+            except OSError:
+                return
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            client = Client(self, sock)
+            with self.lock:
+                self.clients.append(client)
+                self.connections += 1
+                self.changed.notify_all()
+            threading.Thread(target=client.serve, daemon=True).start()
+
+    def remove(self, client):
+        with self.lock:
+            if client in self.clients:
+                self.clients.remove(client)
+        client.close()
+
+    def apply(self, event):
+        with self.lock:
+            self.events += 1
+            if event.get("disconnect"):
+                clients, self.clients = self.clients, []
+            else:
+                clients = []
+                self.player.apply(event)
+                now = time.monotonic()
+                for client in self.clients:
+                    client.notify(now)
+        for client in clients:
+            client.close()
+
+    def wait_idle(self, timeout):
+        """Wait until a client is idling, returns FALSE on timeout"""
+        deadline = time.monotonic() + timeout
+        with self.lock:
+            while not any(c.idle for c in self.clients):
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    return False
+                self.changed.wait(remaining)
+        return True
+
+    def replay(self, trace, speed=1.0, reconnect_timeout=60):
+        """Apply the events of a trace at their time. After a disconnect
+        the clock stops until a client is idling again, scmpc takes its
+        time to reconnect."""
+        start = time.monotonic()
+        for event in trace:
+            delay = start + event.get("t", 0) / speed - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            self.apply(event)
+            if event.get("disconnect"):
+                dropped = time.monotonic()
+                if self.wait_idle(reconnect_timeout):
+                    self.reconnects.append(time.monotonic() - dropped)
+                start += time.monotonic() - dropped
+
+    def close(self):
+        self.listener.close()
+        with self.lock:
+            clients, self.clients = self.clients, []
+        for client in clients:
+            client.close()
+
+
+def record(address, output):
+    """Write a trace of a real MPD's player events until interrupted"""
+    host, _, port = address.partition(":")
+    sock = socket.create_connection((host, int(port or 6600)))
+    reader = sock.makefile("r", encoding="utf-8", newline="\n")
+    reader.readline()
+
+    def command(name):
+        sock.sendall((name + "\n").encode("utf-8"))
+        pairs = {}
+        for line in reader:
+            line = line.rstrip("\n")
+            if line == "OK":
+                return pairs
+            if line.startswith("ACK"):
+                raise RuntimeError(line)
+            key, _, value = line.partition(": ")
+            pairs.setdefault(key, value)
+        raise EOFError
+
+    start = time.monotonic()
+    while True:
+        status = command("status")
+        current = command("currentsong")
+        event = {"t": round(time.monotonic() - start, 3),
+                 "state": status.get("state", "stop"),
+                 "elapsed": float(status.get("elapsed", 0))}
+        if current:
+            event["song"] = {k: current[k] for k in
+                             ("file", "Artist", "Title", "Album", "Track",
+                              "Time") if k in current}
+        output.write(json.dumps(event) + "\n")
+        output.flush()
+        command("idle player")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Fake MPD server that replays player traces")
+    parser.add_argument("--port", type=int, default=0,
+                        help="port to listen on, any free one by default")
+    parser.add_argument("--trace", help="trace file to replay")
+    parser.add_argument("--scenario", choices=SCENARIOS, default="mixed",
+                        help="built-in trace to replay without --trace")
+    parser.add_argument("--speed", type=float, default=1.0,
+                        help="replay this many times faster")
+    parser.add_argument("--dump", action="store_true",
+                        help="print the trace instead of replaying it")
+    parser.add_argument("--record", metavar="HOST[:PORT]",
+                        help="record a trace from a real MPD to stdout")
+    args = parser.parse_args()
+
+    if args.record:
+        try:
+            record(args.record, sys.stdout)
+        except KeyboardInterrupt:
+            pass
+        return 0
+
+    trace = load_trace(args.trace) if args.trace else scenario(args.scenario)
+    if args.dump:
+        for event in trace:
+            print(json.dumps(event))
+        return 0
+
+    server = Server(args.port)
+    server.start()
+    print("listening on 127.0.0.1:%d" % server.port, flush=True)
+    server.wait_idle(3600)
+    server.replay(trace, args.speed)
+    time.sleep(1)
+    server.close()
+    print(json.dumps({"events": server.events, "handled": len(server.handled),
+                      "commands": server.commands}))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,164 @@
+/**
+ * queue_bench.c: Compare the ring buffer queue with the old GQueue.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "preferences.h"
+#include "queue.h"
+
+/**
+ * Songs per batch, as in audioscrobbler.c
+ */
+#define BATCH_SIZE 10
+
+/**
+ * Number of batches looked up at random positions per run
+ */
+#define LOOKUPS 1000
+
+/**
+ * A queue element as it was before the ring buffer and the string pool
+ */
+typedef struct {
+  guint64 id;
+  gchar *album;
+  gchar *artist;
+  gchar *title;
+  gint64 date;
+  guint length;
+  guint track;
+} old_node;
+
+static void bench_gqueue(guint n);
+static void bench_ring(guint n);
+static void report(const gchar *impl, const gchar *op, guint n, guint ops,
+                   gdouble secs);
+
+int main(void) {
+  const guint sizes[] = {10000, 1000000};
+
+  for (guint i = 0; i < G_N_ELEMENTS(sizes); i++) {
+    prefs.queue_length = sizes[i];
+    bench_gqueue(sizes[i]);
+    bench_ring(sizes[i]);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * The previous implementation: one GList link and node per song, walked
+ * with g_queue_peek_nth() for every song of a batch
+ */
+static void bench_gqueue(guint n) {
+  GQueue *queue = g_queue_new();
+  GTimer *timer = g_timer_new();
+  guint sum = 0;
+
+  g_timer_start(timer);
+  for (guint i = 0; i < n; i++) {
+    old_node *song = g_malloc(sizeof(old_node));
+    song->id = i;
+    song->artist = g_strdup("Artist");
+    song->title = g_strdup("Title");
+    song->album = g_strdup("Album");
+    song->length = 180;
+    song->track = 1;
+    song->date = i;
+    g_queue_push_tail(queue, song);
+  }
+  report("gqueue", "add", n, n, g_timer_elapsed(timer, NULL));
+
+  srand(1);
+  g_timer_start(timer);
+  for (guint i = 0; i < LOOKUPS; i++) {
+    guint start = rand() % (n - BATCH_SIZE);
+    for (guint j = 0; j < BATCH_SIZE; j++) {
+      old_node *song = g_queue_peek_nth(queue, start + j);
+      sum += song->length;
+    }
+  }
+  report("gqueue", "batch", n, LOOKUPS, g_timer_elapsed(timer, NULL));
+
+  g_timer_start(timer);
+  while (!g_queue_is_empty(queue)) {
+    old_node *song = g_queue_pop_head(queue);
+    g_free(song->artist);
+    g_free(song->title);
+    g_free(song->album);
+    g_free(song);
+  }
+  report("gqueue", "clear", n, n, g_timer_elapsed(timer, NULL));
+
+  g_queue_free(queue);
+  g_timer_destroy(timer);
+  if (sum == 0)
+    g_print("# unexpected checksum\n");
+}
+
+/**
+ * The ring buffer, walked with queue_peek_range()
+ */
+static void bench_ring(guint n) {
+  GTimer *timer = g_timer_new();
+  guint sum = 0;
+
+  queue_init();
+
+  g_timer_start(timer);
+  for (guint i = 0; i < n; i++)
+    queue_add("Artist", "Title", "Album", 180, 1, i);
+  report("ring", "add", n, n, g_timer_elapsed(timer, NULL));
+
+  srand(1);
+  g_timer_start(timer);
+  for (guint i = 0; i < LOOKUPS; i++) {
+    queue_view view;
+    guint count = queue_peek_range(rand() % (n - BATCH_SIZE), BATCH_SIZE,
+                                   &view);
+    for (guint j = 0; j < count; j++)
+      sum += queue_view_nth(&view, j)->length;
+  }
+  report("ring", "batch", n, LOOKUPS, g_timer_elapsed(timer, NULL));
+
+  g_timer_start(timer);
+  queue_clear_n(n);
+  report("ring", "clear", n, n, g_timer_elapsed(timer, NULL));
+
+  queue_cleanup();
+  g_timer_destroy(timer);
+  if (sum == 0)
+    g_print("# unexpected checksum\n");
+}
+
+/**
+ * Print one result line
+ */
+static void report(const gchar *impl, const gchar *op, guint n, guint ops,
+                   gdouble secs) {
+  g_print("%-6s %-5s n=%-7u %10.1f ns/op\n", impl, op, n, secs * 1e9 / ops);
+}
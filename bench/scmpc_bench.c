@@ -0,0 +1,377 @@
+/**
+ * scmpc_bench.c: Microbenchmarks of the hot paths.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "journal.h"
+#include "lfm.h"
+#include "log.h"
+#include "misc.h"
+#include "preferences.h"
+#include "queue.h"
+#include "request.h"
+#include "strpool.h"
+
+/**
+ * Songs per submission, as in audioscrobbler.c
+ */
+#define BATCH_SIZE 10
+
+/**
+ * Credentials the requests are signed with
+ */
+#define API_KEY "3ec5638071c41a864bf0c8d451566476"
+#define SESSION_KEY "d580d57f32848f5dcf574d1ce18d78b2"
+
+/**
+ * Iterations of the faster benchmarks
+ */
+#define ITERATIONS 100000
+
+/**
+ * Messages logged before waiting for the writer thread
+ */
+#define LOG_BURST 128
+
+/**
+ * The songs of a submission, only their timestamps change
+ */
+static lfm_track tracks[BATCH_SIZE];
+
+static void init_tracks(void);
+static void bench_request(void);
+static void bench_queue_churn(guint n);
+static void bench_cache(guint n);
+static void bench_response(void);
+static void bench_log(const gchar *dir);
+static void bench_submit_log(void);
+static const gchar *build_batch(request *req, guint i);
+static void fill_queue(guint n);
+static void report(const gchar *name, guint n, guint ops, gdouble secs,
+                   guint64 bytes);
+
+/**
+ * Results are written to stdout as one JSON object per line, with the
+ * time per operation in nanoseconds:
+ *
+ *   {"name": "request_multi", "n": 10, "ops": 100000, "ns_per_op": 812.4,
+ *    "bytes": 1423}
+ */
+int main(void) {
+  const guint cache_sizes[] = {1000, 100000, 1000000};
+  as_server server = {.url = "", .username = "bench"};
+  gchar *dir = g_dir_make_tmp("scmpc-bench-XXXXXX", NULL);
+
+  if (!dir) {
+    g_printerr("Could not create a temporary directory\n");
+    return EXIT_FAILURE;
+  }
+
+  prefs.as_servers = &server;
+  prefs.as_count = 1;
+  prefs.cache_file = g_build_filename(dir, "scmpc.cache", NULL);
+  prefs.cache_sync = SYNC_NEVER;
+
+  init_tracks();
+  bench_request();
+  bench_queue_churn(1000);
+  for (guint i = 0; i < G_N_ELEMENTS(cache_sizes); i++)
+    bench_cache(cache_sizes[i]);
+  bench_response();
+  bench_log(dir);
+  bench_submit_log();
+
+  g_free(prefs.cache_file);
+  g_rmdir(dir);
+  g_free(dir);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Build single and batch submissions with lfm_build_scrobble_single() and
+ * lfm_build_scrobble_multi()
+ */
+static void bench_request(void) {
+  GTimer *timer = g_timer_new();
+  request req;
+  gsize len = 0;
+
+  request_init(&req);
+
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++) {
+    tracks[0].date = 1700000000 + i;
+    len += strlen(lfm_build_scrobble_single(&req, API_KEY, SESSION_KEY,
+                                            API_KEY, &tracks[0]));
+  }
+  report("request_single", 1, ITERATIONS, g_timer_elapsed(timer, NULL),
+         len / ITERATIONS);
+
+  len = 0;
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++)
+    len += strlen(build_batch(&req, i));
+  report("request_multi", BATCH_SIZE, ITERATIONS,
+         g_timer_elapsed(timer, NULL), len / ITERATIONS);
+
+  request_clear(&req);
+  g_timer_destroy(timer);
+}
+
+/**
+ * Add a batch and submit it again with n songs queued, as a busy player
+ * does while connected
+ */
+static void bench_queue_churn(guint n) {
+  GTimer *timer = g_timer_new();
+
+  prefs.queue_length = n + BATCH_SIZE;
+  queue_init();
+  fill_queue(n);
+
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS / BATCH_SIZE; i++) {
+    for (guint j = 0; j < BATCH_SIZE; j++)
+      queue_add("Artist", "Title", "Album", 180, j, i);
+    queue_clear_n(BATCH_SIZE);
+  }
+  report("queue_churn", n, ITERATIONS, g_timer_elapsed(timer, NULL), 0);
+
+  queue_cleanup();
+  strpool_cleanup();
+  g_timer_destroy(timer);
+}
+
+/**
+ * Write a snapshot of n songs and load it again
+ */
+static void bench_cache(guint n) {
+  gchar *journal = g_strconcat(prefs.cache_file, ".journal", NULL);
+  GTimer *timer = g_timer_new();
+  struct stat st;
+
+  prefs.queue_length = n;
+  prefs.cache_interval = 0;
+  queue_init();
+  fill_queue(n);
+
+  g_timer_start(timer);
+  journal_open(TRUE);
+  journal_close();
+  g_timer_stop(timer);
+  if (g_stat(prefs.cache_file, &st) < 0)
+    st.st_size = 0;
+  report("cache_save", n, 1, g_timer_elapsed(timer, NULL), st.st_size);
+
+  queue_cleanup();
+  strpool_cleanup();
+  queue_init();
+
+  g_timer_start(timer);
+  queue_load();
+  report("cache_load", n, 1, g_timer_elapsed(timer, NULL), st.st_size);
+  if (queue_get_length() != n)
+    g_printerr("Loaded %u of %u songs\n", queue_get_length(), n);
+
+  queue_cleanup();
+  strpool_cleanup();
+  g_unlink(prefs.cache_file);
+  g_unlink(journal);
+  g_free(journal);
+  g_timer_destroy(timer);
+}
+
+/**
+ * Parse the response to a full batch of scrobbles
+ */
+static void bench_response(void) {
+  GString *body = g_string_new("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                               "<lfm status=\"ok\">\n"
+                               "<scrobbles accepted=\"10\" ignored=\"0\">\n");
+  GTimer *timer = g_timer_new();
+  lfm_response response;
+
+  for (guint i = 0; i < BATCH_SIZE; i++)
+    g_string_append(body,
+                    "<scrobble><track corrected=\"0\">Part I</track>"
+                    "<artist corrected=\"0\">Keith Jarrett</artist>"
+                    "<album corrected=\"0\">The Köln Concert</album>"
+                    "<albumArtist corrected=\"0\"></albumArtist>"
+                    "<timestamp>1700000000</timestamp>"
+                    "<ignoredMessage code=\"0\"></ignoredMessage>"
+                    "</scrobble>\n");
+  g_string_append(body, "</scrobbles>\n</lfm>\n");
+
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS / BATCH_SIZE; i++) {
+    lfm_parse(body->str, body->len, &response);
+    lfm_response_clear(&response);
+  }
+  report("response_parse", BATCH_SIZE, ITERATIONS / BATCH_SIZE,
+         g_timer_elapsed(timer, NULL), body->len);
+
+  g_string_free(body, TRUE);
+  g_timer_destroy(timer);
+}
+
+/**
+ * Log a querystring dump to a file directly and through the writer thread,
+ * and drop one below the log level. Buffered messages are logged in bursts
+ * that fit the buffer, only the time spent in the logging call counts.
+ */
+static void bench_log(const gchar *dir) {
+  gchar *filename = g_build_filename(dir, "scmpc.log", NULL);
+  const gchar *message = "querystring = api_key=3ec5638071c41a864bf0c8d45156"
+                         "6476&method=track.scrobble&sk=d580d57f32848f5dcf57"
+                         "4d1ce18d78b2&album=The%20K%C3%B6ln%20Concert";
+  GTimer *timer = g_timer_new();
+
+  prefs.fork = TRUE;
+  open_log(filename);
+
+  prefs.log_level = G_LOG_LEVEL_DEBUG;
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++)
+    scmpc_log(NULL, G_LOG_LEVEL_DEBUG, message, NULL);
+  report("log_written", 1, ITERATIONS, g_timer_elapsed(timer, NULL),
+         strlen(message));
+
+  start_log_writer();
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++) {
+    scmpc_log(NULL, G_LOG_LEVEL_DEBUG, message, NULL);
+    if (i % LOG_BURST == LOG_BURST - 1) {
+      g_timer_stop(timer);
+      flush_log();
+      g_timer_continue(timer);
+    }
+  }
+  g_timer_stop(timer);
+  stop_log_writer();
+  report("log_buffered", 1, ITERATIONS, g_timer_elapsed(timer, NULL),
+         strlen(message));
+
+  prefs.log_level = G_LOG_LEVEL_INFO;
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++)
+    scmpc_log(NULL, G_LOG_LEVEL_DEBUG, message, NULL);
+  report("log_dropped", 1, ITERATIONS, g_timer_elapsed(timer, NULL), 0);
+
+  g_unlink(filename);
+  g_free(filename);
+  g_timer_destroy(timer);
+}
+
+/**
+ * Build and log a submission with debug messages off, once formatting the
+ * querystring dump as g_debug() does and once checking the level first as
+ * as_job_run() does
+ */
+static void bench_submit_log(void) {
+  GTimer *timer = g_timer_new();
+  request req;
+  gsize len = 0;
+
+  request_init(&req);
+  g_log_set_default_handler(scmpc_log, NULL);
+  prefs.log_level = G_LOG_LEVEL_MESSAGE;
+
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++) {
+    const gchar *body = build_batch(&req, i);
+
+    g_debug("querystring = %s", body);
+    len += strlen(body);
+  }
+  report("submit_debug_formatted", BATCH_SIZE, ITERATIONS,
+         g_timer_elapsed(timer, NULL), len / ITERATIONS);
+
+  len = 0;
+  g_timer_start(timer);
+  for (guint i = 0; i < ITERATIONS; i++) {
+    const gchar *body = build_batch(&req, i);
+
+    scmpc_trace("querystring = %s", body);
+    len += strlen(body);
+  }
+  report("submit_debug_off", BATCH_SIZE, ITERATIONS,
+         g_timer_elapsed(timer, NULL), len / ITERATIONS);
+
+  g_log_set_default_handler(g_log_default_handler, NULL);
+  request_clear(&req);
+  g_timer_destroy(timer);
+}
+
+static void init_tracks(void) {
+  for (guint i = 0; i < BATCH_SIZE; i++) {
+    tracks[i].id = i + 1;
+    tracks[i].artist = (gchar *)"Keith Jarrett";
+    tracks[i].album = (gchar *)"The Köln Concert";
+    tracks[i].title = (gchar *)"Part I";
+    tracks[i].length = 1564;
+    tracks[i].track = i + 1;
+  }
+}
+
+/**
+ * Build a submission of #BATCH_SIZE songs
+ */
+static const gchar *build_batch(request *req, guint i) {
+  for (guint j = 0; j < BATCH_SIZE; j++)
+    tracks[j].date = 1700000000 + i;
+  return lfm_build_scrobble_multi(req, API_KEY, SESSION_KEY, API_KEY, tracks,
+                                  BATCH_SIZE);
+}
+
+static void fill_queue(guint n) {
+  gchar artist[32], album[32], title[32];
+
+  // a few hundred artists and albums, as in a real library
+  for (guint i = 0; i < n; i++) {
+    g_snprintf(artist, sizeof(artist), "Artist %u", i % 300);
+    g_snprintf(album, sizeof(album), "Album %u", i % 1000);
+    g_snprintf(title, sizeof(title), "Title %u", i);
+    queue_add(artist, title, album, 180 + i % 120, i % 20, 1700000000 + i);
+  }
+}
+
+/**
+ * Print one result line
+ */
+static void report(const gchar *name, guint n, guint ops, gdouble secs,
+                   guint64 bytes) {
+  g_print("{\"name\": \"%s\", \"n\": %u, \"ops\": %u, \"ns_per_op\": %.1f, "
+          "\"bytes\": %" G_GUINT64_FORMAT "}\n",
+          name, n, ops, secs * 1e9 / ops, bytes);
+}
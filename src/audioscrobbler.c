@@ -33,454 +33,845 @@
 #include <mpd/client.h>
 
 #include "audioscrobbler.h"
+#include "backoff.h"
+#include "http.h"
+#include "lfm.h"
+#include "log.h"
 #include "misc.h"
 #include "mpd.h"
 #include "preferences.h"
 #include "queue.h"
+#include "request.h"
 #include "scmpc.h"
+#include "trace.h"
+#include "worker.h"
 
-static void as_parse_error(char *response);
-static gboolean as_submit(void);
-static gushort build_querystring(gchar **qs);
-static gushort build_querystring_multi(gchar **qs);
-static gushort build_querystring_single(gchar **qs);
+/**
+ * Maximum number of songs per submission
+ */
+#define BATCH_SIZE 10
+
+// the request of a full batch, parameters that don't fit would be dropped
+G_STATIC_ASSERT(3 + 6 * BATCH_SIZE <= REQUEST_MAX_PARAMS);
+
+typedef enum { AS_AUTHENTICATE, AS_NOW_PLAYING, AS_SUBMIT } as_job_type;
+
+/**
+ * A request for the worker thread. Everything the worker reads is copied
+ * when the job is created, the endpoint itself is only touched again on
+ * the main thread once the job is done.
+ */
+typedef struct {
+  worker_job job;
+  as_job_type type;
+  as_endpoint *endpoint;
+  /* request, immutable once pushed */
+  gchar *url;
+  gchar *api_key;
+  gchar *secret;
+  gchar *session_id;
+  gchar *username;
+  gchar *password;
+  gchar *password_hash;
+  /* copied out of the queue, the queue may change before the response
+   * arrives, so songs are referred to by id on the way back */
+  lfm_track tracks[BATCH_SIZE];
+  gushort num;
+  /* the POST body, taken from the request builder while it is sent */
+  gchar *body;
+  gsize body_size;
+  /* result, filled in by the worker */
+  gint64 started;
+  gint64 finished;
+  CURLcode result;
+  lfm_response response;
+  /* the response body if it couldn't be parsed */
+  gchar *raw;
+} as_job;
+
+/**
+ * The bit of an endpoint in queue_node.acked
+ */
+#define ENDPOINT_BIT(e) (1u << (e)->index)
+
+/**
+ * Queue id of the first song of a job, for the tracepoints
+ */
+#define JOB_FIRST_ID(job) ((job)->num > 0 ? (job)->tracks[0].id : 0)
+
+static void as_authenticate_endpoint(as_endpoint *e);
+static void as_check_submit_endpoint(as_endpoint *e);
+static void as_schedule_endpoint(as_endpoint *e);
+static gboolean as_send_now_playing(as_endpoint *e, mpd_instance *m);
+static backoff_class as_parse_error(as_endpoint *e,
+                                    const lfm_response *response);
+static gboolean as_retry_authenticate(gpointer data);
+static gboolean as_retry_submit(gpointer data);
+static gboolean as_flush(gpointer data);
+static guint as_first_unsent(as_endpoint *e);
+static void as_account_song(as_endpoint *e, guint64 id);
+static as_job *as_job_new(as_endpoint *e, as_job_type type);
+static gboolean as_job_push(as_job *job);
+static void as_job_run(worker_job *job);
+static void as_job_finished(CURLcode result, const gchar *response,
+                            gsize length, gpointer data);
+static void as_job_done(worker_job *job);
+static void as_job_free(worker_job *job);
+static void as_authenticate_done(as_job *job);
+static void as_now_playing_done(as_job *job);
+static void as_submit_done(as_job *job);
+static gboolean as_submit(as_endpoint *e);
+static void as_drain_finish(as_endpoint *e);
+static const gchar *build_auth_url(as_job *job);
+
+/**
+ * Request builder, only used on the worker thread
+ */
+static request as_request;
 
 #define API_URL "http://ws.audioscrobbler.com/2.0/"
+#define API_URL_HTTPS "https://ws.audioscrobbler.com/2.0/"
 #define API_KEY "3ec5638071c41a864bf0c8d451566476"
 #define API_SECRET "365e18391ccdee3bf820cb3d2ba466f6"
 
 gboolean as_connection_init(void) {
-  as_conn.handle = curl_easy_init();
-  if (!as_conn.handle)
+  // before the worker thread exists
+  request_init(&as_request);
+  if (!worker_init()) {
+    request_clear(&as_request);
     return FALSE;
-  as_conn.session_id = NULL;
-  as_conn.last_auth = 0;
-  as_conn.last_fail = 0;
-  as_conn.status = DISCONNECTED;
-  as_conn.headers =
-      curl_slist_append(as_conn.headers, "User-Agent: scmpc/" PACKAGE_VERSION);
-  /* squid workaround */
-  as_conn.headers = curl_slist_append(as_conn.headers, "Expect:");
-
-  curl_easy_setopt(as_conn.handle, CURLOPT_HTTPHEADER, as_conn.headers);
-  curl_easy_setopt(as_conn.handle, CURLOPT_WRITEFUNCTION, &buffer_write);
-  curl_easy_setopt(as_conn.handle, CURLOPT_NOSIGNAL, 1L);
-  curl_easy_setopt(as_conn.handle, CURLOPT_CONNECTTIMEOUT, 5L);
-  curl_easy_setopt(as_conn.handle, CURLOPT_TIMEOUT, 5L);
+  }
+
+  as_conn.count = prefs.as_count;
+  as_conn.endpoints = g_new0(as_endpoint, as_conn.count);
+
+  for (guint i = 0; i < as_conn.count; i++) {
+    as_endpoint *e = &as_conn.endpoints[i];
+    const as_server *server = &prefs.as_servers[i];
+
+    e->server = server;
+    e->index = i;
+
+    // Last.fm unless configured otherwise
+    if (strlen(server->url))
+      e->url = server->url;
+    else
+      e->url = (server->https ? API_URL_HTTPS : API_URL);
+    e->api_key = (strlen(server->api_key) ? server->api_key : API_KEY);
+    e->secret = (strlen(server->secret) ? server->secret : API_SECRET);
+
+    e->auth_name = g_strdup_printf("%s authentication", server->name);
+    e->submit_name = g_strdup_printf("%s submission", server->name);
+    backoff_init(&e->auth_backoff, e->auth_name, as_retry_authenticate, e);
+    backoff_init(&e->submit_backoff, e->submit_name, as_retry_submit, e);
+    e->status = DISCONNECTED;
+    e->drain_timer = g_timer_new();
+  }
 
   return TRUE;
 }
 
 void as_cleanup(void) {
-  curl_slist_free_all(as_conn.headers);
-  curl_easy_cleanup(as_conn.handle);
-  as_conn.headers = as_conn.handle = NULL;
-  g_free(as_conn.session_id);
+  // running requests are aborted and handed back while the endpoints
+  // still exist
+  as_conn.stopping = TRUE;
+  worker_cleanup();
+  request_clear(&as_request);
+
+  for (guint i = 0; i < as_conn.count; i++) {
+    as_endpoint *e = &as_conn.endpoints[i];
+
+    if (e->stats.submitted > 0)
+      scmpc_debug("%u songs submitted to %s after %.1f seconds in the queue "
+                  "on average, %" G_GINT64_FORMAT " at most.",
+                  e->stats.submitted, e->server->name,
+                  (gdouble)e->stats.queue_time_total / e->stats.submitted,
+                  e->stats.queue_time_max);
+
+    if (e->flush_source > 0)
+      g_source_remove(e->flush_source);
+    backoff_reset(&e->auth_backoff);
+    backoff_reset(&e->submit_backoff);
+
+    g_free(e->session_id);
+    g_free(e->auth_name);
+    g_free(e->submit_name);
+    if (e->drain_timer)
+      g_timer_destroy(e->drain_timer);
+  }
+  g_free(as_conn.endpoints);
+  as_conn.endpoints = NULL;
+  as_conn.count = 0;
+  as_conn.stopping = FALSE;
+}
+
+/**
+ * Create a job for an endpoint, with copies of everything the worker needs
+ * to sign and send it
+ */
+static as_job *as_job_new(as_endpoint *e, as_job_type type) {
+  as_job *job = g_new0(as_job, 1);
+
+  job->job.run = as_job_run;
+  job->job.done = as_job_done;
+  job->job.destroy = as_job_free;
+  job->type = type;
+  job->endpoint = e;
+  job->url = g_strdup(e->url);
+  job->api_key = g_strdup(e->api_key);
+  job->secret = g_strdup(e->secret);
+  job->session_id = g_strdup(e->session_id);
+  if (type == AS_AUTHENTICATE) {
+    job->username = g_strdup(e->server->username);
+    job->password = g_strdup(e->server->password);
+    job->password_hash = g_strdup(e->server->password_hash);
+  }
+  return job;
+}
+
+/**
+ * Hand a job to the worker thread, it is freed if the worker can't take it
+ */
+static gboolean as_job_push(as_job *job) {
+  // responses handled at shutdown don't start anything new
+  if (as_conn.stopping) {
+    as_job_free(&job->job);
+    return FALSE;
+  }
+
+  if (worker_push(&job->job))
+    return TRUE;
+
+  g_message("Network worker is busy, not contacting %s.",
+            job->endpoint->server->name);
+  as_job_free(&job->job);
+  return FALSE;
+}
+
+static void as_job_free(worker_job *data) {
+  as_job *job = (as_job *)data;
+
+  g_free(job->url);
+  g_free(job->api_key);
+  g_free(job->secret);
+  g_free(job->session_id);
+  g_free(job->username);
+  g_free(job->password);
+  g_free(job->password_hash);
+  for (gushort i = 0; i < job->num; i++) {
+    g_free(job->tracks[i].artist);
+    g_free(job->tracks[i].album);
+    g_free(job->tracks[i].title);
+  }
+  lfm_response_clear(&job->response);
+  g_free(job->raw);
+  g_free(job);
+}
+
+/**
+ * Sign a job and send it, on the worker thread
+ */
+static void as_job_run(worker_job *data) {
+  as_job *job = (as_job *)data;
+  const gchar *body;
+
+  job->started = g_get_monotonic_time();
+  TRACE3(build_start, job->type, JOB_FIRST_ID(job), job->num);
+  switch (job->type) {
+  case AS_AUTHENTICATE:
+    body = build_auth_url(job);
+    break;
+  case AS_NOW_PLAYING:
+    body = lfm_build_now_playing(&as_request, job->api_key, job->session_id,
+                                 job->secret, &job->tracks[0]);
+    break;
+  case AS_SUBMIT:
+  default:
+    if (job->num > 1)
+      body = lfm_build_scrobble_multi(&as_request, job->api_key,
+                                      job->session_id, job->secret,
+                                      job->tracks, job->num);
+    else
+      body = lfm_build_scrobble_single(&as_request, job->api_key,
+                                       job->session_id, job->secret,
+                                       &job->tracks[0]);
+    break;
+  }
+  TRACE3(build_end, job->type, job->num, as_request.len);
+
+  TRACE3(request_start, job->type, JOB_FIRST_ID(job), job->num);
+  if (job->type == AS_AUTHENTICATE) {
+    scmpc_trace("auth_url = %s", body);
+    http_get(body, as_job_finished, job);
+  } else {
+    // cURL sends the body from the builder's buffer, which is handed back
+    // once the request has finished
+    gsize length = as_request.len;
+
+    scmpc_trace("querystring = %s", body);
+    job->body = request_steal(&as_request, &job->body_size);
+    http_post(job->url, job->body, length, as_job_finished, job);
+  }
+}
+
+/**
+ * Parse the response to a job and hand it back, on the worker thread
+ */
+static void as_job_finished(CURLcode result, const gchar *response,
+                            gsize length, gpointer data) {
+  as_job *job = data;
+
+  job->finished = g_get_monotonic_time();
+  job->result = result;
+  if (job->body)
+    request_recycle(&as_request, job->body, job->body_size);
+  job->body = NULL;
+  TRACE4(request_end, job->type, JOB_FIRST_ID(job), result, length);
+  if (result == CURLE_OK && !lfm_parse(response, length, &job->response))
+    job->raw = g_strndup(response, length);
+  worker_job_done(&job->job);
+}
+
+/**
+ * Act on the result of a job, on the main thread
+ */
+static void as_job_done(worker_job *data) {
+  as_job *job = (as_job *)data;
+  as_stats *stats = &job->endpoint->stats;
+  gint64 duration = job->finished - job->started;
+
+  // requests aborted at shutdown didn't fail, their songs simply stay in
+  // the queue for the next run
+  if (as_conn.stopping && job->result == CURLE_ABORTED_BY_CALLBACK) {
+    if (job->type == AS_AUTHENTICATE)
+      job->endpoint->auth_pending = FALSE;
+    else if (job->type == AS_SUBMIT)
+      job->endpoint->in_flight--;
+    as_job_free(data);
+    return;
+  }
+
+  TRACE5(response, job->type, JOB_FIRST_ID(job), job->result,
+         job->response.status, duration);
+  switch (job->type) {
+  case AS_AUTHENTICATE:
+    metrics_observe(&stats->auth_time, duration);
+    as_authenticate_done(job);
+    break;
+  case AS_NOW_PLAYING:
+    metrics_observe(&stats->now_playing_time, duration);
+    as_now_playing_done(job);
+    break;
+  case AS_SUBMIT:
+  default:
+    metrics_observe(&stats->submit_time, duration);
+    as_submit_done(job);
+    break;
+  }
+  as_job_free(data);
 }
 
 void as_authenticate(void) {
-  gchar *auth_token, *api_sig, *auth_url, *tmp;
-  gint ret;
+  for (guint i = 0; i < as_conn.count; i++)
+    as_authenticate_endpoint(&as_conn.endpoints[i]);
+}
+
+/**
+ * Send an authentication request to an endpoint
+ */
+static void as_authenticate_endpoint(as_endpoint *e) {
+  const as_server *server = e->server;
 
-  if (as_conn.status == BADAUTH) {
+  if (e->status == BADAUTH) {
     g_message("Refusing authentication, please check your "
-              "Audioscrobbler credentials and restart %s",
-              PACKAGE_NAME);
+              "%s credentials and restart %s",
+              server->name, PACKAGE_NAME);
     return;
   }
 
-  if (!strlen(prefs.as_username) ||
-      (!strlen(prefs.as_password) && !strlen(prefs.as_password_hash))) {
+  if (!strlen(server->username) ||
+      (!strlen(server->password) && !strlen(server->password_hash))) {
     g_message("No username or password specified. "
-              "Not connecting to Audioscrobbler.");
-    as_conn.status = BADAUTH;
+              "Not connecting to %s.",
+              server->name);
+    e->status = BADAUTH;
     return;
   }
 
-  if (elapsed(as_conn.last_auth) < 1800) {
-    g_debug("Requested authentication, but last try "
-            "was less than 30 minutes ago.");
+  if (e->auth_pending)
+    return;
+
+  if (backoff_pending(&e->auth_backoff)) {
+    scmpc_debug("Requested authentication, but a retry is already scheduled.");
     return;
   }
 
+  if (as_job_push(as_job_new(e, AS_AUTHENTICATE)))
+    e->auth_pending = TRUE;
+  else
+    backoff_fail(&e->auth_backoff, BACKOFF_NETWORK);
+}
+
+/**
+ * Build the authentication URL of a job
+ */
+static const gchar *build_auth_url(as_job *job) {
+  gchar *auth_token, *tmp;
+  const gchar *auth_url;
+
   // compute auth_token
-  if (strlen(prefs.as_password_hash) > 0) {
-    tmp = g_strdup_printf("%s%s", prefs.as_username, prefs.as_password_hash);
+  if (strlen(job->password_hash) > 0) {
+    tmp = g_strdup_printf("%s%s", job->username, job->password_hash);
   } else {
     auth_token =
-        g_compute_checksum_for_string(G_CHECKSUM_MD5, prefs.as_password, -1);
-    tmp = g_strdup_printf("%s%s", prefs.as_username, auth_token);
+        g_compute_checksum_for_string(G_CHECKSUM_MD5, job->password, -1);
+    tmp = g_strdup_printf("%s%s", job->username, auth_token);
     g_free(auth_token);
   }
   auth_token = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
   g_free(tmp);
 
-  // compute api_sig
-  tmp = g_strdup_printf("api_key" API_KEY "authToken%smethod"
-                        "auth.getMobileSessionusername%s" API_SECRET,
-                        auth_token, prefs.as_username);
-  api_sig = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
-  g_free(tmp);
+  request_start(&as_request, job->url);
+  request_add(&as_request, "method", "auth.getMobileSession");
+  request_add(&as_request, "username", job->username);
+  request_add(&as_request, "authToken", auth_token);
+  request_add(&as_request, "api_key", job->api_key);
+  auth_url = request_finish(&as_request, job->secret);
 
-  auth_url = g_strdup_printf(
-      API_URL "?method=auth.getMobileSession"
-              "&username=%s&authToken=%s&api_key=" API_KEY "&api_sig="
-              "%s",
-      prefs.as_username, auth_token, api_sig);
   g_free(auth_token);
-  g_free(api_sig);
-
-  g_debug("auth_url = %s", auth_url);
+  return auth_url;
+}
 
-  curl_easy_setopt(as_conn.handle, CURLOPT_WRITEDATA, buffer);
-  curl_easy_setopt(as_conn.handle, CURLOPT_HTTPGET, 1);
-  curl_easy_setopt(as_conn.handle, CURLOPT_URL, auth_url);
+/**
+ * Handle the response to an authentication request
+ */
+static void as_authenticate_done(as_job *job) {
+  as_endpoint *e = job->endpoint;
+  lfm_response *parsed = &job->response;
 
-  ret = curl_easy_perform(as_conn.handle);
-  g_free(auth_url);
+  e->auth_pending = FALSE;
 
-  if (ret) {
-    g_warning("Could not connect to the Audioscrobbler: %s",
-              curl_easy_strerror(ret));
-    g_free(buffer);
-    buffer = NULL;
+  if (job->result != CURLE_OK) {
+    g_warning("Could not connect to %s: %s", e->server->name,
+              curl_easy_strerror(job->result));
+    backoff_fail(&e->auth_backoff, BACKOFF_NETWORK);
     return;
   }
 
-  as_conn.last_auth = get_time();
-  if (!buffer) {
-    g_message("Could not parse Audioscrobbler response.");
-    g_free(buffer);
-    buffer = NULL;
-    return;
-  }
-
-  if (strstr(buffer, "<lfm status=\"ok\">")) {
-    char *tmp = strstr(buffer, "<key>") + 5;
-    as_conn.session_id = g_strndup(tmp, strcspn(tmp, "<"));
-    g_message("Connected to Audioscrobbler.");
-    as_conn.status = CONNECTED;
-  } else if (strstr(buffer, "<lfm status=\"failed\">")) {
-    as_parse_error(buffer);
+  if (parsed->status == LFM_OK && parsed->session_key) {
+    backoff_reset(&e->auth_backoff);
+    g_free(e->session_id);
+    e->session_id = parsed->session_key;
+    parsed->session_key = NULL;
+    g_message("Connected to %s.", e->server->name);
+    e->status = CONNECTED;
+
+    // submit the queue that has built up in the meantime and announce
+    // the songs that started playing before we were connected
+    as_check_submit_endpoint(e);
+    for (guint i = 0; i < mpd.count; i++) {
+      mpd_instance *m = &mpd.instances[i];
+
+      if (m->song && m->song_state == SONG_NEW && m->status &&
+          mpd_status_get_state(m->status) == MPD_STATE_PLAY &&
+          as_send_now_playing(e, m))
+        m->song_state = SONG_ANNOUNCED;
+    }
+  } else if (parsed->status == LFM_FAILED) {
+    backoff_class cls = as_parse_error(e, parsed);
+    if (e->status != BADAUTH)
+      backoff_fail(&e->auth_backoff, cls);
   } else {
-    g_message("Could not parse Audioscrobbler response");
-    g_debug("Response was: %s", buffer);
+    g_message("Could not parse %s response", e->server->name);
+    scmpc_trace("Response was: %s", job->raw);
+    backoff_fail(&e->auth_backoff, BACKOFF_SERVER);
   }
-  g_free(buffer);
-  buffer = NULL;
 }
 
-void as_now_playing(void) {
-  gchar *querystring, *tmp, *sig, *artist, *album, *title;
-  const gchar *trackstr, *albumstr, *artiststr, *titlestr;
-  gint ret;
-  guint length, track = 0;
+static gboolean as_retry_authenticate(gpointer data) {
+  count_wakeup(WAKEUP_AS_RETRY);
+  as_authenticate_endpoint(data);
+  return FALSE;
+}
 
-  if (as_conn.status != CONNECTED) {
-    g_message("Not sending Now Playing notification:"
-              " not connected");
-    return;
-  }
+void as_now_playing(mpd_instance *m) {
+  gboolean sent = FALSE;
 
-  albumstr = mpd_song_get_tag(mpd.song, MPD_TAG_ALBUM, 0);
-  artiststr = mpd_song_get_tag(mpd.song, MPD_TAG_ARTIST, 0);
-  titlestr = mpd_song_get_tag(mpd.song, MPD_TAG_TITLE, 0);
-  trackstr = mpd_song_get_tag(mpd.song, MPD_TAG_TRACK, 0);
-  if (trackstr)
-    track = strtol(trackstr, NULL, 10);
-  length = mpd_song_get_duration(mpd.song);
+  for (guint i = 0; i < as_conn.count; i++)
+    sent |= as_send_now_playing(&as_conn.endpoints[i], m);
 
-  if (!artiststr || !titlestr) {
-    g_message("Not sending Now Playing notification: Missing tags");
-    return;
-  }
-
-  tmp = g_strdup_printf("%s%sapi_key" API_KEY "artist%sduration%d"
-                        "methodtrack.updateNowPlayingsk%strack%s",
-                        (albumstr ? "album" : ""), (albumstr ? albumstr : ""),
-                        artiststr, length, as_conn.session_id, titlestr);
+  // don't announce this song again when resuming from pause
+  if (sent)
+    m->song_state = SONG_ANNOUNCED;
+}
 
-  if (track > 0) {
-    sig = g_strdup(tmp);
-    g_free(tmp);
-    tmp = g_strdup_printf("%strackNumber%d", sig, track);
-    g_free(sig);
+/**
+ * Send the Now Playing notification of an endpoint, returns whether it
+ * was sent
+ */
+static gboolean as_send_now_playing(as_endpoint *e, mpd_instance *m) {
+  const gchar *trackstr;
+  lfm_track *track;
+  as_job *job;
+
+  if (e->status != CONNECTED) {
+    g_message("Not sending Now Playing notification to %s:"
+              " not connected",
+              e->server->name);
+    return FALSE;
   }
 
-  sig = g_strdup(tmp);
-  g_free(tmp);
-  tmp = g_strconcat(sig, API_SECRET, NULL);
-  g_free(sig);
+  if (!m->artist || !m->title) {
+    g_message("Not sending Now Playing notification: Missing tags");
+    return FALSE;
+  }
 
-  sig = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
-  g_free(tmp);
+  job = as_job_new(e, AS_NOW_PLAYING);
+  track = &job->tracks[0];
+  track->artist = g_strdup(m->artist);
+  track->album = g_strdup(m->album);
+  track->title = g_strdup(m->title);
+  trackstr = mpd_song_get_tag(m->song, MPD_TAG_TRACK, 0);
+  if (trackstr)
+    track->track = strtol(trackstr, NULL, 10);
+  track->length = mpd_song_get_duration(m->song);
+  job->num = 1;
 
-  artist = curl_easy_escape(as_conn.handle, artiststr, 0);
-  title = curl_easy_escape(as_conn.handle, titlestr, 0);
-  if (albumstr)
-    album = curl_easy_escape(as_conn.handle, albumstr, 0);
-
-  querystring =
-      g_strdup_printf("api_key=" API_KEY "&artist=%s"
-                      "&duration=%d&method=track.updateNowPlaying&sk=%s"
-                      "&track=%s&api_sig=%s",
-                      artist, length, as_conn.session_id, title, sig);
-
-  if (albumstr) {
-    tmp = strdup(querystring);
-    g_free(querystring);
-    querystring = g_strconcat(tmp, "&album=", album, NULL);
-    g_free(tmp);
-  }
+  return as_job_push(job);
+}
 
-  if (track > 0) {
-    tmp = strdup(querystring);
-    g_free(querystring);
-    querystring = g_strdup_printf("%s&trackNumber=%d", tmp, track);
-    g_free(tmp);
-  }
+/**
+ * Handle the response to a Now Playing notification
+ */
+static void as_now_playing_done(as_job *job) {
+  as_endpoint *e = job->endpoint;
+  const lfm_response *parsed = &job->response;
 
-  if (albumstr)
-    curl_free(album);
-  curl_free(artist);
-  curl_free(title);
-  g_free(sig);
-
-  g_debug("querystring = %s", querystring);
-
-  curl_easy_setopt(as_conn.handle, CURLOPT_WRITEDATA, buffer);
-  curl_easy_setopt(as_conn.handle, CURLOPT_POSTFIELDS, querystring);
-  curl_easy_setopt(as_conn.handle, CURLOPT_URL, API_URL);
-
-  ret = curl_easy_perform(as_conn.handle);
-  g_free(querystring);
-  if (ret) {
-    g_warning("Failed to connect to Audioscrobbler: %s",
-              curl_easy_strerror(ret));
-    g_free(buffer);
-    buffer = NULL;
+  if (job->result != CURLE_OK) {
+    g_warning("Failed to connect to %s: %s", e->server->name,
+              curl_easy_strerror(job->result));
     return;
   }
 
-  mpd.song_state = SONG_ANNOUNCED;
-
-  if (strstr(buffer, "<lfm status=\"ok\">")) {
-    g_message("Sent Now Playing notification.");
-  } else if (strstr(buffer, "<lfm status=\"failed\">")) {
-    as_parse_error(buffer);
+  if (parsed->status == LFM_OK && parsed->now_playing != LFM_IGNORED_NONE) {
+    g_message("Now Playing notification was ignored by %s (code %d).",
+              e->server->name, parsed->now_playing);
+  } else if (parsed->status == LFM_OK) {
+    g_message("Sent Now Playing notification to %s.", e->server->name);
+  } else if (parsed->status == LFM_FAILED) {
+    as_parse_error(e, parsed);
   } else {
-    g_debug("Unknown response from Audioscrobbler while "
-            "sending Now Playing notification.");
+    scmpc_debug("Unknown response from %s while "
+                "sending Now Playing notification.",
+                e->server->name);
   }
-
-  g_free(buffer);
-  buffer = NULL;
-}
-
-/**
- * Build the song submission query string
- */
-static gushort build_querystring(gchar **qs) {
-  if (queue_get_length() > 1)
-    return build_querystring_multi(qs);
-  else
-    return build_querystring_single(qs);
 }
 
 /**
- * Build a simple submission string for only one item
+ * Return the position of the first song an endpoint hasn't been sent yet.
+ * With nothing in flight that is the first song it doesn't have, songs
+ * that failed before are sent again.
  */
-static gushort build_querystring_single(gchar **qs) {
-  gchar *sig, *tmp, *album, *artist, *title;
-  queue_node *song = queue_peek_head();
-
-  tmp = g_strdup_printf(
-      "album%sapi_key" API_KEY "artist%sduration%d"
-      "methodtrack.scrobblesk%stimestamp%" G_GINT64_FORMAT "track%s"
-      "tracknumber%d" API_SECRET,
-      song->album, song->artist, song->length, as_conn.session_id, song->date,
-      song->title, song->track);
-  sig = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
-  g_free(tmp);
-
-  if (song->album)
-    album = curl_easy_escape(as_conn.handle, song->album, 0);
-  else
-    album = "";
-  artist = curl_easy_escape(as_conn.handle, song->artist, 0);
-  title = curl_easy_escape(as_conn.handle, song->title, 0);
-
-  *qs = g_strdup_printf(
-      "api_key=" API_KEY "&method=track.scrobble&sk=%s"
-      "&album=%s&artist=%s&duration=%d&timestamp=%" G_GINT64_FORMAT "&track=%s"
-      "&tracknumber=%d&api_sig=%s",
-      as_conn.session_id, album, artist, song->length, song->date, title,
-      song->track, sig);
-
-  if (song->album)
-    curl_free(album);
-  curl_free(artist);
-  curl_free(title);
-  g_free(sig);
-  return 1;
+static guint as_first_unsent(as_endpoint *e) {
+  guint pos = (e->in_flight > 0 ? queue_find_id(e->next_id) : 0), count;
+  queue_view view;
+
+  // songs at the head may only be waiting for other endpoints
+  while ((count = queue_peek_range(pos, BATCH_SIZE, &view)) > 0) {
+    for (guint i = 0; i < count; i++) {
+      if (!(queue_view_nth(&view, i)->acked & ENDPOINT_BIT(e)))
+        return pos + i;
+    }
+    pos += count;
+  }
+  return pos;
 }
 
 /**
- * Build a more complex string using array notation for up to 10 songs
+ * Submit the next batch of songs after the submission cursor of an endpoint
  */
-static gushort build_querystring_multi(gchar **qs) {
-  gchar *sig, *tmp;
-  GString *nqs;
-  GString *albums, *artists, *lengths, *timestamps, *titles;
-  GString *tracks;
-  gushort num = 0;
-  queue_node *song = queue_peek_head();
-
-  nqs = g_string_new("api_key=" API_KEY "&method=track.scrobble&sk=");
-  g_string_append(nqs, as_conn.session_id);
-
-  albums = g_string_new("");
-  artists = g_string_new("");
-  lengths = g_string_new("");
-  timestamps = g_string_new("");
-  titles = g_string_new("");
-  tracks = g_string_new("");
-
-  while (song && num < 10) {
-    gchar *album, *artist, *title;
-
-    g_string_append_printf(albums, "album[%d]%s", num, song->album);
-    g_string_append_printf(artists, "artist[%d]%s", num, song->artist);
-    g_string_append_printf(lengths, "duration[%d]%d", num, song->length);
-    g_string_append_printf(timestamps, "timestamp[%d]%" G_GINT64_FORMAT, num,
-                           song->date);
-    g_string_append_printf(titles, "track[%d]%s", num, song->title);
-    g_string_append_printf(tracks, "trackNumber[%d]%d", num, song->track);
-
-    album = curl_easy_escape(as_conn.handle, song->album, 0);
-    artist = curl_easy_escape(as_conn.handle, song->artist, 0);
-    title = curl_easy_escape(as_conn.handle, song->title, 0);
-
-    g_string_append_printf(
-        nqs, "&album[%1$d]=%2$s"
-             "&artist[%1$d]=%3$s&duration[%1$d]=%4$d"
-             "&timestamp[%1$d]=%5$" G_GINT64_FORMAT "&track[%1$d]=%6$s"
-             "&trackNumber[%1$d]=%7$d",
-        num, album, artist, song->length, song->date, title, song->track);
-
-    curl_free(album);
-    curl_free(artist);
-    curl_free(title);
-
-    num++;
-    song = queue_peek_nth(num);
+static gboolean as_submit(as_endpoint *e) {
+  guint pos = as_first_unsent(e), count;
+  guint64 last_id;
+  as_job *job = NULL;
+  queue_view view;
+
+  // the batch is usually filled from a single view, songs this endpoint
+  // already has make it look further
+  while ((!job || job->num < BATCH_SIZE) &&
+         (count = queue_peek_range(pos, BATCH_SIZE, &view)) > 0) {
+    for (guint i = 0; i < count && (!job || job->num < BATCH_SIZE); i++) {
+      const queue_node *song = queue_view_nth(&view, i);
+      lfm_track *track;
+
+      if (song->acked & ENDPOINT_BIT(e))
+        continue;
+      if (!job)
+        job = as_job_new(e, AS_SUBMIT);
+
+      // the queue's strings may go away while the worker uses them
+      track = &job->tracks[job->num++];
+      track->id = song->id;
+      track->artist = g_strdup(song->artist);
+      track->album = g_strdup(song->album);
+      track->title = g_strdup(song->title);
+      track->date = song->date;
+      track->length = song->length;
+      track->track = song->track;
+    }
+    pos += count;
   }
+  if (!job)
+    return FALSE;
 
-  tmp = g_strdup_printf("%sapi_key" API_KEY "%s%smethodtrack.scrobble"
-                        "sk%s%s%s%s" API_SECRET,
-                        albums->str, artists->str, lengths->str,
-                        as_conn.session_id, timestamps->str, tracks->str,
-                        titles->str);
-  sig = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
-  g_free(tmp);
-  g_string_free(albums, TRUE);
-  g_string_free(artists, TRUE);
-  g_string_free(lengths, TRUE);
-  g_string_free(timestamps, TRUE);
-  g_string_free(titles, TRUE);
-  g_string_free(tracks, TRUE);
-
-  g_string_append_printf(nqs, "&api_sig=%s", sig);
-  g_free(sig);
-
-  *qs = g_string_free(nqs, FALSE);
-  return num;
+  last_id = job->tracks[job->num - 1].id;
+  if (!as_job_push(job))
+    return FALSE;
+
+  e->next_id = last_id + 1;
+  e->in_flight++;
+  return TRUE;
 }
 
 /**
- * Submit new songs from the queue
+ * Handle the response to a submission. Songs the endpoint accepted or
+ * rejected for good are acknowledged, everything else is sent again.
  */
-static gboolean as_submit(void) {
-  gchar *querystring;
-  gint ret;
-  gushort num_songs;
-
-  if (queue_get_length() < 1)
-    return FALSE;
-
-  num_songs = build_querystring(&querystring);
-  if (num_songs <= 0) {
-    g_free(querystring);
-    return FALSE;
+static void as_submit_done(as_job *job) {
+  as_endpoint *e = job->endpoint;
+  const lfm_response *parsed = &job->response;
+  guint removed = 0, retry = 0;
+
+  e->in_flight--;
+
+  if (job->result != CURLE_OK) {
+    g_message("Failed to connect to %s: %s", e->server->name,
+              curl_easy_strerror(job->result));
+    backoff_fail(&e->submit_backoff, BACKOFF_NETWORK);
+    retry = job->num;
+  } else if (parsed->status == LFM_INVALID) {
+    g_message("Could not parse %s submit response,"
+              " keeping songs for the next attempt.",
+              e->server->name);
+    scmpc_trace("Response was: %s", job->raw);
+    backoff_fail(&e->submit_backoff, BACKOFF_SERVER);
+    retry = job->num;
+  } else if (parsed->status == LFM_FAILED) {
+    backoff_fail(&e->submit_backoff, as_parse_error(e, parsed));
+    retry = job->num;
+  } else if (parsed->num_scrobbles != job->num) {
+    // no per-track results to go by, but the request went through
+    scmpc_trace("Expected %u scrobble results, got %u.", job->num,
+                parsed->num_scrobbles);
+    for (gushort i = 0; i < job->num; i++) {
+      as_account_song(e, job->tracks[i].id);
+      queue_acknowledge(job->tracks[i].id, e->index);
+    }
+    removed = job->num;
+    e->stats.accepted += job->num;
+  } else {
+    for (gushort i = 0; i < job->num; i++) {
+      lfm_ignored code = parsed->scrobbles[i];
+
+      if (LFM_IGNORED_RETRYABLE(code)) {
+        retry++;
+        continue;
+      }
+      if (code != LFM_IGNORED_NONE) {
+        scmpc_trace("Song %" G_GUINT64_FORMAT " was ignored (code %d).",
+                    job->tracks[i].id, code);
+        e->stats.ignored++;
+      } else {
+        e->stats.accepted++;
+      }
+      as_account_song(e, job->tracks[i].id);
+      queue_acknowledge(job->tracks[i].id, e->index);
+      removed++;
+    }
+  }
+  e->stats.failed += retry;
+  TRACE4(submit_result, e->server->name, JOB_FIRST_ID(job), removed, retry);
+
+  if (removed > 0)
+    g_message("%u song%s submitted to %s.", removed, (removed > 1 ? "s" : ""),
+              e->server->name);
+  if (retry > 0 && parsed->status == LFM_OK) {
+    // only the daily limit is retryable
+    g_message("%u song%s will be submitted again later.", retry,
+              (retry > 1 ? "s" : ""));
+    backoff_fail(&e->submit_backoff, BACKOFF_RATE_LIMIT);
+  } else if (retry == 0) {
+    backoff_reset(&e->submit_backoff);
   }
 
-  g_debug("querystring = %s", querystring);
-
-  curl_easy_setopt(as_conn.handle, CURLOPT_WRITEDATA, buffer);
-  curl_easy_setopt(as_conn.handle, CURLOPT_POSTFIELDS, querystring);
-  curl_easy_setopt(as_conn.handle, CURLOPT_URL, API_URL);
+  if (e->draining) {
+    e->drained += removed;
+    if (retry > 0)
+      e->drain_failed = TRUE;
 
-  ret = curl_easy_perform(as_conn.handle);
-  g_free(querystring);
-  if (ret != 0) {
-    g_message("Failed to connect to Audioscrobbler: %s",
-              curl_easy_strerror(ret));
-    return FALSE;
-  }
+    // keep the pipeline full
+    if (!e->drain_failed)
+      as_check_submit_endpoint(e);
 
-  if (strstr(buffer, "<lfm status=\"ok\">")) {
-    g_message("%d song%s submitted.", num_songs, (num_songs > 1 ? "s" : ""));
-    queue_clear_n(num_songs);
-  } else if (strstr(buffer, "<lfm status=\"failed\">")) {
-    as_parse_error(buffer);
+    if (e->draining && e->in_flight == 0)
+      as_drain_finish(e);
   } else {
-    g_message("Could not parse Audioscrobbler submit"
-              " response.");
-    g_debug("Response was: %s", buffer);
-
-    // Temporary fix for duplicate submissions problem
-    g_message("Couldn't verify if songs were submitted;"
-              " clearing queue anyway.");
-    queue_clear_n(num_songs);
+    // songs queued while this batch was in flight
+    as_schedule_endpoint(e);
   }
+}
+
+/**
+ * Record how long a song waited in the queue before it was submitted
+ */
+static void as_account_song(as_endpoint *e, guint64 id) {
+  queue_node *song = queue_peek_nth(queue_find_id(id));
+  gint64 waited;
 
-  g_free(buffer);
-  buffer = NULL;
+  if (!song || song->id != id)
+    return;
 
-  return TRUE;
+  waited = MAX(elapsed(song->queued), 0);
+  e->stats.submitted++;
+  e->stats.queue_time_total += waited;
+  e->stats.queue_time_max = MAX(e->stats.queue_time_max, waited);
 }
 
 /**
- * Parse errors returned from Last.fm and adjust the status if applicable
+ * Leave drain mode and report how fast the backlog went out
  */
-static void as_parse_error(char *response) {
-  gchar *tmp, *message;
-  gushort code;
+static void as_drain_finish(as_endpoint *e) {
+  gdouble secs = g_timer_elapsed(e->drain_timer, NULL);
+
+  e->draining = FALSE;
+  g_message("Drained %u song%s to %s in %.1f seconds (%.1f songs/s)%s.",
+            e->drained, (e->drained != 1 ? "s" : ""), e->server->name, secs,
+            (secs > 0 ? e->drained / secs : 0.0),
+            (e->drain_failed ? ", stopped after a failure" : ""));
+}
 
-  tmp = strstr(response, "<error code=\"") + 13;
-  code = g_ascii_strtoll(tmp, NULL, 0);
+/**
+ * Handle errors returned from an endpoint, adjust its status if applicable
+ * and return how to back off before trying again
+ */
+static backoff_class as_parse_error(as_endpoint *e,
+                                    const lfm_response *response) {
+  backoff_class cls = BACKOFF_SERVER;
 
-  switch (code) {
+  switch (response->error_code) {
   case 4:
-    as_conn.status = BADAUTH;
+    e->status = BADAUTH;
     break;
   case 9:
-    as_authenticate();
+    as_authenticate_endpoint(e);
+    break;
+  case 11: // service offline
+  case 16: // temporarily unavailable
+    cls = BACKOFF_OFFLINE;
+    break;
+  case 29: // rate limit exceeded
+    cls = BACKOFF_RATE_LIMIT;
     break;
   default:
     break;
   }
 
-  tmp = strstr(tmp, "\">") + 2;
-  message = g_strndup(tmp, strcspn(tmp, "<"));
-  g_warning("%s", message);
-  g_free(message);
+  g_warning("%s: %s", e->server->name,
+            (response->error_message ? response->error_message
+                                     : "Unknown Audioscrobbler error"));
+  return cls;
+}
+
+static gboolean as_retry_submit(gpointer data) {
+  count_wakeup(WAKEUP_AS_RETRY);
+  as_check_submit_endpoint(data);
+  return FALSE;
+}
+
+static gboolean as_flush(gpointer data) {
+  as_endpoint *e = data;
+
+  count_wakeup(WAKEUP_AS_FLUSH);
+  e->flush_source = 0;
+  as_check_submit_endpoint(e);
+  return FALSE;
+}
+
+void as_schedule_submit(void) {
+  for (guint i = 0; i < as_conn.count; i++)
+    as_schedule_endpoint(&as_conn.endpoints[i]);
+}
+
+/**
+ * Submit to an endpoint once submit_batch songs are waiting for it,
+ * otherwise arm a timer for the oldest one
+ */
+static void as_schedule_endpoint(as_endpoint *e) {
+  guint start, length = queue_get_length();
+  queue_node *oldest;
+  gint64 due;
+
+  // the handshake submits whatever has built up in the meantime
+  if (e->status != CONNECTED)
+    return;
+
+  start = as_first_unsent(e);
+  if (start >= length)
+    return;
+
+  if (length - start >= e->server->submit_batch) {
+    as_check_submit_endpoint(e);
+    return;
+  }
+
+  // the timer already covers the oldest song
+  if (e->flush_source > 0)
+    return;
+
+  oldest = queue_peek_nth(start);
+  due = MAX(oldest->queued + e->server->submit_latency - get_time(), 0);
+  e->flush_source = g_timeout_add_seconds(due, as_flush, e);
+}
+
+void as_get_stats(guint endpoint, as_stats *out) {
+  *out = as_conn.endpoints[endpoint].stats;
 }
 
 void as_check_submit(void) {
-  if (queue_get_length() > 0 && as_conn.status == CONNECTED &&
-      elapsed(as_conn.last_fail) >= 600) {
-    if (as_submit() == FALSE)
-      as_conn.last_fail = get_time();
+  for (guint i = 0; i < as_conn.count; i++)
+    as_check_submit_endpoint(&as_conn.endpoints[i]);
+}
+
+/**
+ * Check if the queue can be submitted to an endpoint and do it
+ */
+static void as_check_submit_endpoint(as_endpoint *e) {
+  guint max_requests = 1, waiting;
+
+  if (e->status != CONNECTED || backoff_pending(&e->submit_backoff))
+    return;
+
+  // everything waiting goes out now
+  if (e->flush_source > 0)
+    g_source_remove(e->flush_source);
+  e->flush_source = 0;
+
+  waiting = queue_get_length() - as_first_unsent(e);
+  if (!e->draining && e->server->drain_requests > 0 && waiting > BATCH_SIZE) {
+    g_message("%u songs queued for %s, draining the backlog.", waiting,
+              e->server->name);
+    e->draining = TRUE;
+    e->drain_failed = FALSE;
+    e->drained = 0;
+    g_timer_start(e->drain_timer);
   }
+
+  if (e->draining)
+    max_requests = (e->drain_failed ? 0 : e->server->drain_requests);
+
+  while (e->in_flight < max_requests && as_submit(e))
+    ;
+
+  if (e->draining && e->in_flight == 0)
+    as_drain_finish(e);
 }
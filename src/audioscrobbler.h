@@ -26,53 +26,111 @@
 #ifndef HAVE_AUDIOSCROBBLER_H
 #define HAVE_AUDIOSCROBBLER_H
 
-/* curl/curl.h requires sys/select.h but doesn't include it on FreeBSD */
-#include <curl/curl.h>
 #include <glib.h>
-#include <sys/select.h>
 
+#include "backoff.h"
+#include "metrics.h"
 #include "misc.h"
+#include "preferences.h"
+
+struct mpd_instance;
 
 /**
- * Last.fm connection data
+ * Submissions to an endpoint, queue times are in seconds
  */
-struct {
+typedef struct {
+  guint submitted;
+  gint64 queue_time_total;
+  gint64 queue_time_max;
+  /* songs by the outcome of their submission, failed ones are retried */
+  guint accepted;
+  guint ignored;
+  guint failed;
+  /* requests by method, from signing to the end of the transfer */
+  metrics_histogram auth_time;
+  metrics_histogram now_playing_time;
+  metrics_histogram submit_time;
+} as_stats;
+
+/**
+ * A scrobbling service, one for each audioscrobbler section. Every endpoint
+ * has its own session, retry state and cursor into the shared queue, so a
+ * slow one doesn't hold up the others.
+ */
+typedef struct {
+  const as_server *server;
+  guint index;
+  const gchar *url;
+  const gchar *api_key;
+  const gchar *secret;
   gchar *session_id;
-  gint64 last_auth;
-  gint64 last_fail;
+  gchar *auth_name;
+  gchar *submit_name;
+  backoff auth_backoff;
+  backoff submit_backoff;
   connection_status status;
-  CURL *handle;
-  struct curl_slist *headers;
-} as_conn;
+  gboolean auth_pending;
+  guint64 next_id;
+  guint in_flight;
+  gboolean draining;
+  gboolean drain_failed;
+  guint drained;
+  GTimer *drain_timer;
+  guint flush_source;
+  as_stats stats;
+} as_endpoint;
 
 /**
- * cURL data buffer
+ * Scrobbling endpoints
  */
-gchar *buffer;
+struct {
+  as_endpoint *endpoints;
+  guint count;
+  /* set while #as_cleanup stops the worker */
+  gboolean stopping;
+} as_conn;
 
 /**
- * Initialize cURL
+ * Start the network worker thread and set up an endpoint for every
+ * audioscrobbler section. Requests are signed, sent and parsed on the
+ * worker, their results are handled on the main thread.
  */
 gboolean as_connection_init(void);
 
 /**
- * Build Last.fm authentication string and send it
+ * Build authentication strings and send them to all endpoints
  */
 void as_authenticate(void);
 
 /**
- * Check if the queue can be submitted and do it
+ * Check if the queue can be submitted to each endpoint and do it. A backlog
+ * of more than one batch is drained with up to drain_requests submissions
+ * in flight.
  */
 void as_check_submit(void);
 
 /**
- * Release resources
+ * Submit once submit_batch songs are waiting, otherwise make sure the
+ * oldest waiting song goes out within submit_latency seconds
+ */
+void as_schedule_submit(void);
+
+/**
+ * Fill stats with the queue latency, outcomes and request times of the
+ * submissions to an endpoint so far
+ */
+void as_get_stats(guint endpoint, as_stats *stats);
+
+/**
+ * Stop the worker thread and release resources. Requests that already
+ * finished are still handled.
  */
 void as_cleanup(void);
 
 /**
- * Build "Now playing" notification string and send it
+ * Build "Now playing" notification strings for the song playing on an MPD
+ * server and send them to all endpoints
  */
-void as_now_playing(void);
+void as_now_playing(struct mpd_instance *instance);
 
 #endif /* HAVE_AUDIOSCROBBLER_H */
@@ -0,0 +1,104 @@
+/**
+ * backoff.c: Retry scheduling with exponential backoff.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include "backoff.h"
+
+/**
+ * Delays for a class of failures, in seconds
+ */
+typedef struct {
+  guint initial;
+  guint max;
+} backoff_policy;
+
+/**
+ * A network blip should only cost a few seconds, while an outage or rate
+ * limit is waited out with far fewer requests. Reconnecting to MPD is
+ * cheap and plays go unnoticed until it succeeds, so it is never put off
+ * for long.
+ */
+static const backoff_policy policies[BACKOFF_CLASSES] = {
+    [BACKOFF_NETWORK] = {2, 600},
+    [BACKOFF_SERVER] = {15, 1800},
+    [BACKOFF_OFFLINE] = {60, 1800},
+    [BACKOFF_RATE_LIMIT] = {300, 3600},
+    [BACKOFF_MPD] = {2, 60},
+};
+
+static gboolean backoff_timeout(gpointer data);
+
+void backoff_init(backoff *b, const gchar *name, GSourceFunc retry,
+                  gpointer data) {
+  b->name = name;
+  b->retry = retry;
+  b->data = data;
+  b->failures = 0;
+  b->source = 0;
+  b->delay = 0;
+}
+
+guint backoff_fail(backoff *b, backoff_class cls) {
+  const backoff_policy *policy = &policies[cls];
+  guint64 delay = policy->initial * 1000;
+
+  // double the delay for every failure in a row
+  for (guint i = 0; i < b->failures && delay < policy->max * 1000; i++)
+    delay *= 2;
+  delay = MIN(delay, policy->max * 1000);
+  b->failures++;
+
+  // wait between half and all of it, so clients don't retry in lockstep
+  delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+  // in whole seconds, so the retry shares a wakeup with other timers
+  delay = (delay + 999) / 1000 * 1000;
+
+  if (b->source > 0)
+    g_source_remove(b->source);
+  b->source = g_timeout_add_seconds(delay / 1000, backoff_timeout, b);
+  b->delay = delay;
+
+  g_message("Retrying %s in %.1f seconds (failure %u).", b->name,
+            delay / 1000.0, b->failures);
+  return delay;
+}
+
+void backoff_reset(backoff *b) {
+  if (b->source > 0)
+    g_source_remove(b->source);
+  b->source = 0;
+  b->failures = 0;
+  b->delay = 0;
+}
+
+gboolean backoff_pending(const backoff *b) { return b->source > 0; }
+
+static gboolean backoff_timeout(gpointer data) {
+  backoff *b = data;
+
+  b->source = 0;
+  b->delay = 0;
+  b->retry(b->data);
+  return FALSE;
+}
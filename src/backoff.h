@@ -0,0 +1,80 @@
+/**
+ * backoff.h: Retry scheduling with exponential backoff.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_BACKOFF_H
+#define HAVE_BACKOFF_H
+
+#include <glib.h>
+
+/**
+ * Kinds of failures, each with its own delays
+ */
+typedef enum {
+  BACKOFF_NETWORK,    /* connection failures and timeouts */
+  BACKOFF_SERVER,     /* errors and garbage from the server */
+  BACKOFF_OFFLINE,    /* the service said it is offline */
+  BACKOFF_RATE_LIMIT, /* we are sending too much */
+  BACKOFF_MPD,        /* MPD went away, usually for a restart */
+  BACKOFF_CLASSES
+} backoff_class;
+
+/**
+ * Retry state of one kind of request
+ */
+typedef struct {
+  const gchar *name;
+  GSourceFunc retry;
+  gpointer data;
+  guint failures;
+  guint source;
+  /* of the scheduled retry, in milliseconds */
+  guint delay;
+} backoff;
+
+/**
+ * Set up b, retry is called with data from the main loop once a delay has
+ * passed
+ */
+void backoff_init(backoff *b, const gchar *name, GSourceFunc retry,
+                  gpointer data);
+
+/**
+ * Record a failure and schedule a retry. The delay grows exponentially with
+ * the number of failures in a row, is capped per class and jittered.
+ * Returns the delay in milliseconds.
+ */
+guint backoff_fail(backoff *b, backoff_class cls);
+
+/**
+ * Record a success, cancelling a scheduled retry
+ */
+void backoff_reset(backoff *b);
+
+/**
+ * Whether a retry is scheduled, requests should wait for it
+ */
+gboolean backoff_pending(const backoff *b);
+
+#endif /* HAVE_BACKOFF_H */
@@ -0,0 +1,451 @@
+/**
+ * cache.c: Binary snapshot of the song queue.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "log.h"
+#include "preferences.h"
+#include "queue.h"
+#include "strpool.h"
+
+/*
+ * All integers are little-endian. The file starts with a fixed header:
+ *
+ *   magic[8] version:u32 songs:u32 dict_offset:u64 dict_count:u32
+ *   endpoints:u32
+ *
+ * followed by the songs in queue order:
+ *
+ *   id:u64 date:i64 length:u32 track:u32 artist:u32 album:u32
+ *   acked:u32 title_len:u32 title[title_len]
+ *
+ * acked is the set of endpoints that already have the song. Version 1
+ * files don't have it.
+ *
+ * artist and album are indices into the dictionary at dict_offset, which
+ * holds dict_count strings as len:u32 bytes[len]. Strings are not
+ * NUL-terminated. The dictionary is followed by the keys of the endpoints
+ * that bits of acked stand for, as endpoints:u32 dictionary indices.
+ * Versions 1 and 2 don't have them, their endpoints count is 0.
+ */
+#define CACHE_MAGIC "SCMPCQ\r\n"
+#define CACHE_VERSION 3
+#define HEADER_SIZE 32
+#define SONG_SIZE 40
+#define SONG_SIZE_V1 36
+
+/**
+ * Buffered bytes after which the writer flushes to disk
+ */
+#define WRITE_BUFFER 65536
+
+struct cache_writer {
+  gchar *filename;
+  gchar *tmp_filename;
+  gint fd;
+  GString *buf;
+  guint64 offset;
+  guint32 songs;
+  GHashTable *dict;
+  GPtrArray *strings;
+  gint64 started;
+};
+
+static cache_stats stats;
+
+static cache_format load_binary(const gchar *data, gsize len,
+                                const gchar *filename);
+static cache_format load_legacy(const gchar *data, gsize len);
+static guint32 get_u32(const gchar *p);
+static guint64 get_u64(const gchar *p);
+static void put_u32(GString *buf, guint32 value);
+static void put_u64(GString *buf, guint64 value);
+static guint32 dict_index(cache_writer *writer, const gchar *str);
+static gboolean writer_flush(cache_writer *writer);
+static gboolean write_all(gint fd, const gchar *buf, gsize len);
+static void writer_free(cache_writer *writer);
+
+cache_format cache_load(const gchar *filename) {
+  GMappedFile *file;
+  GError *error = NULL;
+  cache_format format;
+  const gchar *data;
+  gsize len;
+
+  file = g_mapped_file_new(filename, FALSE, &error);
+  if (!file) {
+    if (error->code != G_FILE_ERROR_NOENT)
+      g_message("Failed to open cache file for reading: %s", error->message);
+    g_error_free(error);
+    return CACHE_MISSING;
+  }
+
+  data = g_mapped_file_get_contents(file);
+  len = g_mapped_file_get_length(file);
+
+  if (len == 0)
+    format = CACHE_MISSING;
+  else if (len >= HEADER_SIZE && !memcmp(data, CACHE_MAGIC, 8))
+    format = load_binary(data, len, filename);
+  else if (len >= 12 && !memcmp(data, "# BEGIN SONG", 12))
+    format = load_legacy(data, len);
+  else {
+    g_warning("%s is not a scmpc cache file, it will be replaced.", filename);
+    format = CACHE_INVALID;
+  }
+
+  g_mapped_file_unref(file);
+  return format;
+}
+
+/**
+ * Load a binary snapshot, bounds-checking every field
+ */
+static cache_format load_binary(const gchar *data, gsize len,
+                                const gchar *filename) {
+  guint32 version, songs, dict_count, endpoints, n, i = 0;
+  guint64 dict_offset;
+  gsize song_size;
+  const gchar *p, *end;
+  const gchar **dict;
+  const gchar *keys[QUEUE_MAX_ENDPOINTS] = {NULL};
+  queue_endpoint_map map;
+
+  version = get_u32(data + 8);
+  if (version > CACHE_VERSION || version == 0) {
+    g_warning("%s has unsupported version %u, it will be replaced.", filename,
+              version);
+    return CACHE_INVALID;
+  }
+  song_size = (version == 1 ? SONG_SIZE_V1 : SONG_SIZE);
+
+  songs = get_u32(data + 12);
+  dict_offset = get_u64(data + 16);
+  dict_count = get_u32(data + 24);
+  endpoints = (version < 3 ? 0 : get_u32(data + 28));
+  if (dict_offset < HEADER_SIZE || dict_offset > len ||
+      dict_count > (len - dict_offset) / 4 ||
+      endpoints > QUEUE_MAX_ENDPOINTS) {
+    g_warning("%s is corrupt, it will be replaced.", filename);
+    return CACHE_INVALID;
+  }
+
+  // intern the dictionary straight from the mapping, songs then only take
+  // references to it
+  dict = g_new0(const gchar *, dict_count);
+  p = data + dict_offset;
+  end = data + len;
+  for (n = 0; n < dict_count; n++) {
+    guint32 l;
+    if (end - p < 4 || (guint32)(end - p - 4) < (l = get_u32(p)))
+      break;
+    dict[n] = strpool_intern_len(p + 4, l);
+    p += 4 + l;
+  }
+
+  // endpoints that can't be read lose their acknowledgements
+  for (n = (n < dict_count ? endpoints : 0); n < endpoints && end - p >= 4;
+       n++, p += 4) {
+    guint32 index = get_u32(p);
+    if (index < dict_count)
+      keys[n] = dict[index];
+  }
+  if (version >= 3)
+    queue_map_endpoints(&map, keys, endpoints);
+
+  p = data + HEADER_SIZE;
+  end = data + dict_offset;
+  for (; i < songs; i++) {
+    guint32 artist, album, title_len, acked;
+
+    if ((gsize)(end - p) < song_size)
+      break;
+    artist = get_u32(p + 24);
+    album = get_u32(p + 28);
+    title_len = get_u32(p + song_size - 4);
+    if ((guint64)(end - p - song_size) < title_len || artist >= dict_count ||
+        album >= dict_count || !dict[artist] || !dict[album])
+      break;
+
+    // version 2 files were written before endpoints were saved, their bits
+    // are taken as they are
+    acked = (version == 1 ? 0 : get_u32(p + 32));
+    if (version >= 3)
+      acked = queue_map_acked(&map, acked);
+
+    queue_restore_len(get_u64(p), dict[artist], p + song_size, title_len,
+                      dict[album], get_u32(p + 16), get_u32(p + 20),
+                      (gint64)get_u64(p + 8), acked);
+    p += song_size + title_len;
+  }
+
+  if (i < songs)
+    g_warning("%s is corrupt, only %u of %u songs could be loaded.", filename,
+              i, songs);
+
+  for (n = 0; n < dict_count; n++)
+    strpool_unref(dict[n]);
+  g_free(dict);
+  return CACHE_BINARY;
+}
+
+/**
+ * Load a text cache file written by scmpc 0.4 and older
+ */
+static cache_format load_legacy(const gchar *data, gsize len) {
+  const gchar *line = data, *end = data + len;
+  gchar *artist = NULL, *title = NULL, *album = NULL;
+  gint64 date = 0;
+  guint track = 0, length = 0;
+
+  while (line < end) {
+    const gchar *eol = memchr(line, '\n', end - line);
+    gsize l = (eol ? eol : end) - line;
+    gchar *value = NULL;
+
+    if (l >= 12 && !strncmp(line, "# BEGIN SONG", 12)) {
+      g_free(artist);
+      g_free(title);
+      g_free(album);
+      artist = title = album = NULL;
+      length = track = date = 0;
+    } else if (l >= 10 && !strncmp(line, "# END SONG", 10)) {
+      queue_add(artist, title, album, length, track, date);
+    } else if (l >= 8 && !strncmp(line, "artist: ", 8)) {
+      g_free(artist);
+      artist = g_strndup(line + 8, l - 8);
+    } else if (l >= 7 && !strncmp(line, "title: ", 7)) {
+      g_free(title);
+      title = g_strndup(line + 7, l - 7);
+    } else if (l >= 7 && !strncmp(line, "album: ", 7)) {
+      g_free(album);
+      album = g_strndup(line + 7, l - 7);
+    } else if (l >= 6 && !strncmp(line, "date: ", 6)) {
+      value = g_strndup(line + 6, l - 6);
+      date = g_ascii_strtoll(value, NULL, 10);
+    } else if (l >= 8 && !strncmp(line, "length: ", 8)) {
+      value = g_strndup(line + 8, l - 8);
+      length = strtol(value, NULL, 10);
+    } else if (l >= 7 && !strncmp(line, "track: ", 7)) {
+      value = g_strndup(line + 7, l - 7);
+      track = strtol(value, NULL, 10);
+    }
+    g_free(value);
+
+    line += l + 1;
+  }
+
+  g_free(artist);
+  g_free(title);
+  g_free(album);
+  return CACHE_LEGACY;
+}
+
+cache_writer *cache_writer_new(const gchar *filename) {
+  cache_writer *writer = g_malloc0(sizeof(cache_writer));
+  gchar header[HEADER_SIZE] = {0};
+
+  writer->filename = g_strdup(filename);
+  writer->tmp_filename = g_strconcat(filename, ".tmp", NULL);
+  writer->fd = open(writer->tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0) {
+    g_warning("Failed to open cache file for writing: %s", g_strerror(errno));
+    writer_free(writer);
+    return NULL;
+  }
+
+  // the header is filled in on commit
+  writer->buf = g_string_sized_new(WRITE_BUFFER);
+  g_string_append_len(writer->buf, header, HEADER_SIZE);
+  writer->dict = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  writer->strings = g_ptr_array_new();
+  writer->started = g_get_monotonic_time();
+
+  return writer;
+}
+
+gboolean cache_writer_add(cache_writer *writer, const queue_node *song) {
+  gsize title_len = strlen(song->title);
+
+  put_u64(writer->buf, song->id);
+  put_u64(writer->buf, (guint64)song->date);
+  put_u32(writer->buf, song->length);
+  put_u32(writer->buf, song->track);
+  put_u32(writer->buf, dict_index(writer, song->artist));
+  put_u32(writer->buf, dict_index(writer, song->album));
+  put_u32(writer->buf, song->acked);
+  put_u32(writer->buf, title_len);
+  g_string_append_len(writer->buf, song->title, title_len);
+  writer->songs++;
+
+  if (writer->buf->len >= WRITE_BUFFER)
+    return writer_flush(writer);
+  return TRUE;
+}
+
+gboolean cache_writer_commit(cache_writer *writer) {
+  GString *header = g_string_sized_new(HEADER_SIZE);
+  guint64 dict_offset = writer->offset + writer->buf->len;
+  guint32 keys[QUEUE_MAX_ENDPOINTS];
+  gboolean ret;
+
+  for (guint i = 0; i < prefs.as_count; i++) {
+    gchar *key = queue_endpoint_key(i);
+    keys[i] = dict_index(writer, key);
+    g_free(key);
+  }
+
+  for (guint i = 0; i < writer->strings->len; i++) {
+    const gchar *str = g_ptr_array_index(writer->strings, i);
+    gsize len = strlen(str);
+    put_u32(writer->buf, len);
+    g_string_append_len(writer->buf, str, len);
+  }
+
+  for (guint i = 0; i < prefs.as_count; i++)
+    put_u32(writer->buf, keys[i]);
+
+  g_string_append_len(header, CACHE_MAGIC, 8);
+  put_u32(header, CACHE_VERSION);
+  put_u32(header, writer->songs);
+  put_u64(header, dict_offset);
+  put_u32(header, writer->strings->len);
+  put_u32(header, prefs.as_count);
+
+  ret = writer_flush(writer) &&
+        pwrite(writer->fd, header->str, HEADER_SIZE, 0) == HEADER_SIZE &&
+        fsync(writer->fd) == 0 &&
+        rename(writer->tmp_filename, writer->filename) == 0;
+  g_string_free(header, TRUE);
+
+  if (!ret) {
+    g_warning("Failed to write cache file: %s", g_strerror(errno));
+    cache_writer_abort(writer);
+    return FALSE;
+  }
+
+  scmpc_debug("Cache saved: %u songs, %u strings, %" G_GUINT64_FORMAT
+              " bytes.",
+              writer->songs, writer->strings->len, writer->offset);
+  stats.saves++;
+  stats.bytes = writer->offset;
+  metrics_observe(&stats.save_time, g_get_monotonic_time() - writer->started);
+  writer_free(writer);
+  return TRUE;
+}
+
+void cache_writer_abort(cache_writer *writer) {
+  if (writer->fd >= 0)
+    unlink(writer->tmp_filename);
+  writer_free(writer);
+}
+
+void cache_get_stats(cache_stats *out) { *out = stats; }
+
+/**
+ * Return the dictionary index of str, adding it if it's new
+ */
+static guint32 dict_index(cache_writer *writer, const gchar *str) {
+  gpointer index = g_hash_table_lookup(writer->dict, str);
+  gchar *copy;
+
+  if (index)
+    return GPOINTER_TO_UINT(index) - 1;
+
+  copy = g_strdup(str);
+  g_ptr_array_add(writer->strings, copy);
+  g_hash_table_insert(writer->dict, copy,
+                      GUINT_TO_POINTER(writer->strings->len));
+  return writer->strings->len - 1;
+}
+
+/**
+ * Write out the buffered data
+ */
+static gboolean writer_flush(cache_writer *writer) {
+  if (!write_all(writer->fd, writer->buf->str, writer->buf->len))
+    return FALSE;
+
+  writer->offset += writer->buf->len;
+  g_string_truncate(writer->buf, 0);
+  return TRUE;
+}
+
+/**
+ * write() that retries on short writes and EINTR
+ */
+static gboolean write_all(gint fd, const gchar *buf, gsize len) {
+  while (len > 0) {
+    gssize ret = write(fd, buf, len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return FALSE;
+    buf += ret;
+    len -= ret;
+  }
+  return TRUE;
+}
+
+static void writer_free(cache_writer *writer) {
+  if (writer->fd >= 0)
+    close(writer->fd);
+  if (writer->buf)
+    g_string_free(writer->buf, TRUE);
+  if (writer->dict)
+    g_hash_table_destroy(writer->dict);
+  if (writer->strings)
+    g_ptr_array_free(writer->strings, TRUE);
+  g_free(writer->filename);
+  g_free(writer->tmp_filename);
+  g_free(writer);
+}
+
+static guint32 get_u32(const gchar *p) {
+  guint32 value;
+  memcpy(&value, p, sizeof value);
+  return GUINT32_FROM_LE(value);
+}
+
+static guint64 get_u64(const gchar *p) {
+  guint64 value;
+  memcpy(&value, p, sizeof value);
+  return GUINT64_FROM_LE(value);
+}
+
+static void put_u32(GString *buf, guint32 value) {
+  value = GUINT32_TO_LE(value);
+  g_string_append_len(buf, (const gchar *)&value, sizeof value);
+}
+
+static void put_u64(GString *buf, guint64 value) {
+  value = GUINT64_TO_LE(value);
+  g_string_append_len(buf, (const gchar *)&value, sizeof value);
+}
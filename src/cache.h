@@ -0,0 +1,92 @@
+/**
+ * cache.h: Binary snapshot of the song queue.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_CACHE_H
+#define HAVE_CACHE_H
+
+#include <glib.h>
+
+#include "metrics.h"
+#include "queue.h"
+
+/**
+ * What #cache_load found
+ */
+typedef enum {
+  CACHE_MISSING,
+  CACHE_BINARY,
+  CACHE_LEGACY,
+  CACHE_INVALID
+} cache_format;
+
+/**
+ * Snapshots written since startup
+ */
+typedef struct {
+  guint saves;
+  /* size of the last snapshot */
+  guint64 bytes;
+  /* from the first song to moving the snapshot into place */
+  metrics_histogram save_time;
+} cache_stats;
+
+/**
+ * A snapshot being written
+ */
+typedef struct cache_writer cache_writer;
+
+/**
+ * Load a snapshot into the queue. Text cache files written by scmpc 0.4
+ * and older are loaded as well and reported as #CACHE_LEGACY.
+ */
+cache_format cache_load(const gchar *filename);
+
+/**
+ * Start writing a snapshot that will replace filename once committed
+ */
+cache_writer *cache_writer_new(const gchar *filename);
+
+/**
+ * Append a song to the snapshot
+ */
+gboolean cache_writer_add(cache_writer *writer, const queue_node *song);
+
+/**
+ * Write the tables, sync the snapshot and move it into place. The writer
+ * is freed in any case.
+ */
+gboolean cache_writer_commit(cache_writer *writer);
+
+/**
+ * Throw away an unfinished snapshot and free the writer
+ */
+void cache_writer_abort(cache_writer *writer);
+
+/**
+ * Copy the snapshot statistics to stats
+ */
+void cache_get_stats(cache_stats *stats);
+
+#endif /* HAVE_CACHE_H */
@@ -0,0 +1,445 @@
+/**
+ * http.c: Asynchronous HTTP requests.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http.h"
+#include "log.h"
+#include "preferences.h"
+
+/**
+ * Initial size of a response buffer, enough for any Audioscrobbler reply
+ */
+#define RESPONSE_INITIAL 4096
+
+/**
+ * Responses larger than this are aborted
+ */
+#define RESPONSE_MAX (256 * 1024)
+
+/**
+ * A transfer slot. Slots are pooled together with their easy handle and
+ * response buffer, so that neither is set up again for the next request.
+ */
+typedef struct {
+  CURL *handle;
+  GString *response;
+  http_callback callback;
+  gpointer data;
+} http_request;
+
+/**
+ * A socket cURL asked us to watch
+ */
+typedef struct {
+  curl_socket_t fd;
+  guint source;
+} http_socket;
+
+static http_request *http_request_new(const gchar *url, http_callback callback,
+                                      gpointer data);
+static void http_request_start(http_request *req);
+static void http_request_release(http_request *req);
+static gsize http_write(gchar *input, gsize size, gsize nmemb, gpointer data);
+static void http_request_account(http_request *req);
+static void check_multi_info(void);
+static gboolean socket_event(GIOChannel *source, GIOCondition condition,
+                             gpointer data);
+static gboolean timer_event(gpointer data);
+static gint socket_callback(CURL *easy, curl_socket_t s, gint what,
+                            gpointer userp, gpointer socketp);
+static gint timer_callback(CURLM *multi, glong timeout_ms, gpointer userp);
+static guint http_attach(GSource *source, GSourceFunc func, gpointer data);
+static void http_detach(guint id);
+
+/**
+ * cURL multi handle and the main loop sources driving it
+ */
+static struct {
+  GMainContext *context;
+  CURLM *multi;
+  CURLSH *share;
+  struct curl_slist *headers;
+  GSList *idle_requests;
+  GSList *requests;
+  guint timer_source;
+  gint running;
+  /* read from other threads through http_get_stats() */
+  GMutex stats_lock;
+  http_stats stats;
+} http;
+
+gboolean http_init(GMainContext *context) {
+  http.context = context;
+  http.multi = curl_multi_init();
+  if (!http.multi)
+    return FALSE;
+
+  http.headers =
+      curl_slist_append(http.headers, "User-Agent: scmpc/" PACKAGE_VERSION);
+  /* squid workaround */
+  http.headers = curl_slist_append(http.headers, "Expect:");
+
+  curl_multi_setopt(http.multi, CURLMOPT_SOCKETFUNCTION, &socket_callback);
+  curl_multi_setopt(http.multi, CURLMOPT_TIMERFUNCTION, &timer_callback);
+
+  /* Connections are cached by the multi handle already, TLS sessions are
+   * per easy handle unless shared. Resuming them saves a full handshake
+   * whenever a connection has to be opened again. */
+  http.share = curl_share_init();
+  if (http.share) {
+    curl_share_setopt(http.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+#if LIBCURL_VERSION_NUM >= 0x071700
+    curl_share_setopt(http.share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+#endif
+  }
+
+  return TRUE;
+}
+
+void http_cleanup(void) {
+  while (http.requests) {
+    http_request *req = http.requests->data;
+    curl_multi_remove_handle(http.multi, req->handle);
+    req->callback(CURLE_ABORTED_BY_CALLBACK, NULL, 0, req->data);
+    http_request_release(req);
+  }
+
+  while (http.idle_requests) {
+    http_request *req = http.idle_requests->data;
+    curl_easy_cleanup(req->handle);
+    g_string_free(req->response, TRUE);
+    g_free(req);
+    http.idle_requests =
+        g_slist_delete_link(http.idle_requests, http.idle_requests);
+  }
+
+  if (http.timer_source > 0)
+    http_detach(http.timer_source);
+  http.timer_source = 0;
+
+  scmpc_debug("HTTP: %u requests, %u new connections, %u reused.",
+              http.stats.requests, http.stats.new_connections,
+              http.stats.reused_connections);
+
+  curl_multi_cleanup(http.multi);
+  if (http.share)
+    curl_share_cleanup(http.share);
+  curl_slist_free_all(http.headers);
+  http.multi = NULL;
+  http.share = NULL;
+  http.headers = NULL;
+  http.context = NULL;
+}
+
+void http_get_stats(http_stats *stats) {
+  g_mutex_lock(&http.stats_lock);
+  *stats = http.stats;
+  g_mutex_unlock(&http.stats_lock);
+}
+
+void http_get(const gchar *url, http_callback callback, gpointer data) {
+  http_request *req = http_request_new(url, callback, data);
+
+  curl_easy_setopt(req->handle, CURLOPT_HTTPGET, 1L);
+  http_request_start(req);
+}
+
+void http_post(const gchar *url, const gchar *body, gsize length,
+               http_callback callback, gpointer data) {
+  http_request *req = http_request_new(url, callback, data);
+
+  curl_easy_setopt(req->handle, CURLOPT_POSTFIELDSIZE, (glong)length);
+  curl_easy_setopt(req->handle, CURLOPT_POSTFIELDS, body);
+  http_request_start(req);
+}
+
+/**
+ * Set up a transfer, reusing an idle slot if there is one
+ */
+static http_request *http_request_new(const gchar *url, http_callback callback,
+                                      gpointer data) {
+  http_request *req;
+
+  if (http.idle_requests) {
+    req = http.idle_requests->data;
+    http.idle_requests =
+        g_slist_delete_link(http.idle_requests, http.idle_requests);
+    g_string_truncate(req->response, 0);
+  } else {
+    req = g_malloc0(sizeof(http_request));
+    req->handle = curl_easy_init();
+    req->response = g_string_sized_new(RESPONSE_INITIAL);
+    curl_easy_setopt(req->handle, CURLOPT_HTTPHEADER, http.headers);
+    curl_easy_setopt(req->handle, CURLOPT_WRITEFUNCTION, &http_write);
+    curl_easy_setopt(req->handle, CURLOPT_WRITEDATA, req);
+    curl_easy_setopt(req->handle, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(req->handle, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(req->handle, CURLOPT_TIMEOUT, 5L);
+    if (http.share)
+      curl_easy_setopt(req->handle, CURLOPT_SHARE, http.share);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    if (prefs.http_keepalive > 0) {
+      curl_easy_setopt(req->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+      curl_easy_setopt(req->handle, CURLOPT_TCP_KEEPIDLE,
+                       (glong)prefs.http_keepalive);
+      curl_easy_setopt(req->handle, CURLOPT_TCP_KEEPINTVL,
+                       (glong)prefs.http_keepalive);
+    }
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074100
+    if (prefs.http_idle_timeout > 0)
+      curl_easy_setopt(req->handle, CURLOPT_MAXAGE_CONN,
+                       (glong)prefs.http_idle_timeout);
+#endif
+  }
+
+  req->callback = callback;
+  req->data = data;
+  curl_easy_setopt(req->handle, CURLOPT_URL, url);
+
+  return req;
+}
+
+/**
+ * Hand a transfer over to the multi handle, cURL will set up the socket
+ * watches and timeouts it needs through the callbacks
+ */
+static void http_request_start(http_request *req) {
+  CURLMcode ret = curl_multi_add_handle(http.multi, req->handle);
+
+  if (ret != CURLM_OK) {
+    g_warning("Could not start request: %s", curl_multi_strerror(ret));
+    req->callback(CURLE_FAILED_INIT, NULL, 0, req->data);
+    http_request_release(req);
+    return;
+  }
+
+  http.requests = g_slist_prepend(http.requests, req);
+}
+
+/**
+ * Put a finished transfer back into the pool, its easy handle keeps the
+ * connection open for the next one
+ */
+static void http_request_release(http_request *req) {
+  http.requests = g_slist_remove(http.requests, req);
+
+  curl_easy_setopt(req->handle, CURLOPT_POSTFIELDS, NULL);
+  curl_easy_setopt(req->handle, CURLOPT_POSTFIELDSIZE, -1L);
+  req->callback = NULL;
+  req->data = NULL;
+
+  http.idle_requests = g_slist_prepend(http.idle_requests, req);
+}
+
+/**
+ * Append received data to the response buffer, aborting the transfer if
+ * it grows beyond #RESPONSE_MAX
+ */
+static gsize http_write(gchar *input, gsize size, gsize nmemb, gpointer data) {
+  http_request *req = data;
+  gsize len = size * nmemb;
+
+  if (req->response->len + len > RESPONSE_MAX) {
+    g_warning("Response exceeds %u bytes, aborting request.", RESPONSE_MAX);
+    return 0;
+  }
+
+  g_string_append_len(req->response, input, len);
+  return len;
+}
+
+/**
+ * Count whether a finished transfer opened a new connection and how long
+ * setting it up took
+ */
+static void http_request_account(http_request *req) {
+  glong connects = 0;
+  gdouble connect = 0, appconnect = 0, handshake;
+
+  curl_easy_getinfo(req->handle, CURLINFO_NUM_CONNECTS, &connects);
+  if (connects == 0) {
+    g_mutex_lock(&http.stats_lock);
+    http.stats.requests++;
+    http.stats.reused_connections++;
+    g_mutex_unlock(&http.stats_lock);
+    return;
+  }
+
+  curl_easy_getinfo(req->handle, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(req->handle, CURLINFO_APPCONNECT_TIME, &appconnect);
+  // appconnect is 0 for plain HTTP
+  handshake = (appconnect > connect ? appconnect - connect : 0);
+  g_mutex_lock(&http.stats_lock);
+  http.stats.requests++;
+  http.stats.new_connections++;
+  http.stats.connect_time += connect;
+  http.stats.handshake_time += handshake;
+  g_mutex_unlock(&http.stats_lock);
+
+  scmpc_trace("New connection: connect %.0f ms, TLS handshake %.0f ms.",
+              connect * 1000, handshake * 1000);
+}
+
+/**
+ * Collect finished transfers and run their callbacks
+ */
+static void check_multi_info(void) {
+  CURLMsg *msg;
+  gint left;
+
+  while ((msg = curl_multi_info_read(http.multi, &left))) {
+    http_request *req;
+    CURLcode result;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    result = msg->data.result;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (gchar **)&req);
+    curl_multi_remove_handle(http.multi, req->handle);
+    http_request_account(req);
+
+    if (result == CURLE_OK)
+      req->callback(result, req->response->str, req->response->len,
+                    req->data);
+    else
+      req->callback(result, NULL, 0, req->data);
+
+    http_request_release(req);
+  }
+}
+
+/**
+ * Activity on one of cURL's sockets
+ */
+static gboolean socket_event(GIOChannel *source, GIOCondition condition,
+                             G_GNUC_UNUSED gpointer data) {
+  gint fd = g_io_channel_unix_get_fd(source);
+  gint action = 0;
+
+  if (condition & G_IO_IN)
+    action |= CURL_CSELECT_IN;
+  if (condition & G_IO_OUT)
+    action |= CURL_CSELECT_OUT;
+  if (condition & (G_IO_ERR | G_IO_HUP))
+    action |= CURL_CSELECT_ERR;
+
+  curl_multi_socket_action(http.multi, fd, action, &http.running);
+  check_multi_info();
+
+  return TRUE;
+}
+
+/**
+ * cURL's timeout expired
+ */
+static gboolean timer_event(G_GNUC_UNUSED gpointer data) {
+  http.timer_source = 0;
+  curl_multi_socket_action(http.multi, CURL_SOCKET_TIMEOUT, 0, &http.running);
+  check_multi_info();
+
+  return FALSE;
+}
+
+/**
+ * Add, change or remove the watch on a socket as requested by cURL
+ */
+static gint socket_callback(G_GNUC_UNUSED CURL *easy, curl_socket_t s,
+                            gint what, G_GNUC_UNUSED gpointer userp,
+                            gpointer socketp) {
+  http_socket *sock = socketp;
+  GIOCondition condition = G_IO_ERR | G_IO_HUP;
+  GIOChannel *channel;
+
+  if (sock && sock->source > 0)
+    http_detach(sock->source);
+
+  if (what == CURL_POLL_REMOVE) {
+    g_free(sock);
+    return 0;
+  }
+
+  if (!sock) {
+    sock = g_malloc0(sizeof(http_socket));
+    sock->fd = s;
+    curl_multi_assign(http.multi, s, sock);
+  }
+
+  if (what & CURL_POLL_IN)
+    condition |= G_IO_IN;
+  if (what & CURL_POLL_OUT)
+    condition |= G_IO_OUT;
+
+  channel = g_io_channel_unix_new(s);
+  sock->source = http_attach(g_io_create_watch(channel, condition),
+                             (GSourceFunc)socket_event, NULL);
+  g_io_channel_unref(channel);
+
+  return 0;
+}
+
+/**
+ * (Re)schedule the timeout requested by cURL
+ */
+static gint timer_callback(G_GNUC_UNUSED CURLM *multi, glong timeout_ms,
+                           G_GNUC_UNUSED gpointer userp) {
+  if (http.timer_source > 0)
+    http_detach(http.timer_source);
+  http.timer_source = 0;
+
+  if (timeout_ms >= 0)
+    http.timer_source =
+        http_attach(g_timeout_source_new(timeout_ms), timer_event, NULL);
+
+  return 0;
+}
+
+/**
+ * Attach a source to the context cURL is driven from
+ */
+static guint http_attach(GSource *source, GSourceFunc func, gpointer data) {
+  guint id;
+
+  g_source_set_callback(source, func, data, NULL);
+  id = g_source_attach(source, http.context);
+  g_source_unref(source);
+  return id;
+}
+
+/**
+ * Remove a source attached with #http_attach
+ */
+static void http_detach(guint id) {
+  GSource *source = g_main_context_find_source_by_id(http.context, id);
+
+  if (source)
+    g_source_destroy(source);
+}
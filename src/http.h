@@ -0,0 +1,84 @@
+/**
+ * http.h: Asynchronous HTTP requests.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_HTTP_H
+#define HAVE_HTTP_H
+
+/* curl/curl.h requires sys/select.h but doesn't include it on FreeBSD */
+#include <curl/curl.h>
+#include <glib.h>
+#include <sys/select.h>
+
+/**
+ * Called from the context cURL is driven from when a request has finished,
+ * or with CURLE_ABORTED_BY_CALLBACK when it is aborted by #http_cleanup.
+ * response is only valid for the duration of the call and is NULL if result
+ * is not CURLE_OK.
+ */
+typedef void (*http_callback)(CURLcode result, const gchar *response,
+                              gsize length, gpointer data);
+
+/**
+ * Connection statistics
+ */
+typedef struct {
+  guint requests;
+  guint new_connections;
+  guint reused_connections;
+  /* seconds spent setting up new connections */
+  gdouble connect_time;
+  gdouble handshake_time;
+} http_stats;
+
+/**
+ * Initialize the cURL multi handle and hook it into context, NULL for the
+ * default main context. All other functions but #http_get_stats must be
+ * called from the thread running that context.
+ */
+gboolean http_init(GMainContext *context);
+
+/**
+ * Abort all running requests and release resources
+ */
+void http_cleanup(void);
+
+/**
+ * Start a GET request for url, callback is invoked once it has finished
+ */
+void http_get(const gchar *url, http_callback callback, gpointer data);
+
+/**
+ * Start a POST request for url. body is sent as it is and has to stay
+ * around until callback is invoked.
+ */
+void http_post(const gchar *url, const gchar *body, gsize length,
+               http_callback callback, gpointer data);
+
+/**
+ * Fill stats with the connection statistics so far, from any thread
+ */
+void http_get_stats(http_stats *stats);
+
+#endif /* HAVE_HTTP_H */
@@ -0,0 +1,597 @@
+/**
+ * journal.c: Append-only journal of queue changes.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "journal.h"
+#include "log.h"
+#include "misc.h"
+#include "preferences.h"
+#include "queue.h"
+
+/*
+ * The journal is a text file with one record per line:
+ *
+ *   + <id> <date> <length> <track> <artist>\t<title>\t<album>
+ *   - <id>
+ *   ~ <id> <endpoint>
+ *   @ <endpoint> <key>
+ *
+ * "+" records a song added to the queue, "-" a song that was submitted to
+ * all endpoints or dropped, "~" a song that one endpoint has acknowledged.
+ * "@" records follow the header and name the endpoint behind each number
+ * by its #queue_endpoint_key, journals without them use the configured
+ * order.
+ * Tabs, newlines and backslashes in tags are backslash-escaped.
+ * A trailing line without a newline is a torn write and ignored.
+ *
+ * The journal only holds the changes since the last snapshot in the cache
+ * file. Compaction writes a new snapshot and starts a new journal.
+ */
+#define JOURNAL_HEADER "# scmpc journal 1\n"
+
+/**
+ * Endpoints named by the "@" records of the journal being replayed
+ */
+typedef struct {
+  gchar *keys[QUEUE_MAX_ENDPOINTS];
+  guint count;
+  gboolean mapped;
+  queue_endpoint_map map;
+} journal_replay_state;
+
+/**
+ * Songs written per main loop iteration while compacting
+ */
+#define COMPACT_CHUNK 1000
+
+/**
+ * Records needed before the journal is folded into a new snapshot
+ */
+#define COMPACT_MIN_RECORDS 128
+
+static gboolean write_all(gint fd, const gchar *buf, gsize len);
+static void append_escaped(GString *buf, const gchar *str);
+static void unescape(gchar *str);
+static void format_enqueued(GString *buf, const queue_node *song);
+static void journal_append(GString *record);
+static void journal_sync(void);
+static gboolean journal_sync_timeout(gpointer data);
+static gboolean replay_record(gchar *line, journal_replay_state *state);
+static void compact_maybe(void);
+static gboolean compact_start(void);
+static gboolean compact_step(void);
+static void compact_finish(void);
+static void compact_abort(void);
+static gboolean compact_idle(gpointer data);
+
+/**
+ * Journal state
+ */
+static struct {
+  gchar *filename;
+  gint fd;
+  guint records;
+  gboolean dirty;
+  guint sync_source;
+  /* compaction in progress */
+  cache_writer *writer;
+  guint compact_source;
+  guint64 compact_cursor;
+  guint64 compact_end;
+  guint compact_records;
+  GString *pending;
+  /* bytes appended since startup */
+  guint64 written;
+  metrics_histogram sync_time;
+} journal = {.fd = -1};
+
+gboolean journal_replay(void) {
+  gchar *contents, *line, *next;
+  GError *error = NULL;
+  journal_replay_state state = {.count = 0};
+  guint songs = 0;
+
+  if (!journal.filename)
+    journal.filename = g_strconcat(prefs.cache_file, ".journal", NULL);
+
+  if (!g_file_get_contents(journal.filename, &contents, NULL, &error)) {
+    if (error->code != G_FILE_ERROR_NOENT)
+      g_message("Failed to read journal: %s", error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  if (!g_str_has_prefix(contents, JOURNAL_HEADER)) {
+    g_warning("%s is not a scmpc journal, ignoring it.", journal.filename);
+    g_free(contents);
+    return FALSE;
+  }
+
+  journal.records = 0;
+  for (line = contents + strlen(JOURNAL_HEADER); (next = strchr(line, '\n'));
+       line = next + 1) {
+    *next = '\0';
+    if (replay_record(line, &state))
+      journal.records++;
+  }
+  if (*line)
+    g_message("Ignoring incomplete record at the end of the journal.");
+  if (state.count > 0 && !state.mapped)
+    queue_map_endpoints(&state.map, (const gchar *const *)state.keys,
+                        state.count);
+
+  for (guint i = 0; i < state.count; i++)
+    g_free(state.keys[i]);
+  g_free(contents);
+  songs = queue_get_length();
+  scmpc_debug("Replayed %u journal records, %u song%s queued.",
+              journal.records, songs, (songs != 1 ? "s" : ""));
+  return TRUE;
+}
+
+/**
+ * Apply a single journal record to the queue
+ */
+static gboolean replay_record(gchar *line, journal_replay_state *state) {
+  gchar *p = line + 2, *artist, *title, *album;
+  guint64 id;
+  gint64 date;
+  guint length, track, endpoint;
+  guint32 bit;
+
+  if (line[0] == '-' && line[1] == ' ') {
+    queue_remove_id(g_ascii_strtoull(p, NULL, 10));
+    return TRUE;
+  } else if (line[0] == '@' && line[1] == ' ') {
+    // endpoints are named in order, before they are first used
+    endpoint = strtoul(p, &p, 10);
+    if (endpoint != state->count || state->mapped || *p++ != ' ')
+      return FALSE;
+    unescape(p);
+    state->keys[state->count++] = g_strdup(p);
+    return TRUE;
+  } else if (line[0] == '~' && line[1] == ' ') {
+    id = g_ascii_strtoull(p, &p, 10);
+    endpoint = strtoul(p, NULL, 10);
+    if (endpoint >= QUEUE_MAX_ENDPOINTS)
+      return FALSE;
+    if (state->count > 0 && !state->mapped) {
+      queue_map_endpoints(&state->map, (const gchar *const *)state->keys,
+                          state->count);
+      state->mapped = TRUE;
+    }
+    bit = (state->count > 0
+               ? queue_map_acked(&state->map, 1u << endpoint)
+               : 1u << endpoint);
+    // acknowledged by an endpoint that is gone
+    if (bit)
+      queue_acknowledge(id, g_bit_nth_lsf(bit, -1));
+    return TRUE;
+  } else if (line[0] != '+' || line[1] != ' ') {
+    return FALSE;
+  }
+
+  id = g_ascii_strtoull(p, &p, 10);
+  date = g_ascii_strtoll(p, &p, 10);
+  length = strtoul(p, &p, 10);
+  track = strtoul(p, &p, 10);
+  if (*p++ != ' ')
+    return FALSE;
+
+  artist = p;
+  if (!(title = strchr(artist, '\t')))
+    return FALSE;
+  *title++ = '\0';
+  if (!(album = strchr(title, '\t')))
+    return FALSE;
+  *album++ = '\0';
+
+  unescape(artist);
+  unescape(title);
+  unescape(album);
+  queue_restore(id, artist, title, album, length, track, date, 0);
+  return TRUE;
+}
+
+gboolean journal_open(gboolean rewrite) {
+  if (!journal.filename)
+    journal.filename = g_strconcat(prefs.cache_file, ".journal", NULL);
+
+  if (rewrite || !g_file_test(journal.filename, G_FILE_TEST_EXISTS)) {
+    if (!compact_start())
+      return FALSE;
+    while (compact_step())
+      ;
+    return journal.fd >= 0;
+  }
+
+  journal.fd = open(journal.filename, O_WRONLY | O_APPEND);
+  if (journal.fd < 0) {
+    g_warning("Failed to open journal for writing: %s", g_strerror(errno));
+    return FALSE;
+  }
+
+  compact_maybe();
+  return TRUE;
+}
+
+void journal_close(void) {
+  while (compact_step())
+    ;
+  if (journal.compact_source > 0)
+    g_source_remove(journal.compact_source);
+  journal.compact_source = 0;
+
+  if (journal.sync_source > 0)
+    g_source_remove(journal.sync_source);
+  journal.sync_source = 0;
+
+  journal_sync();
+  if (journal.fd >= 0)
+    close(journal.fd);
+  journal.fd = -1;
+
+  g_free(journal.filename);
+  journal.filename = NULL;
+}
+
+void journal_enqueued(const queue_node *song) {
+  GString *record;
+
+  if (journal.fd < 0)
+    return;
+
+  record = g_string_sized_new(128);
+  format_enqueued(record, song);
+  journal_append(record);
+  g_string_free(record, TRUE);
+}
+
+void journal_acknowledged(guint64 id) {
+  GString *record;
+
+  if (journal.fd < 0)
+    return;
+
+  record = g_string_sized_new(24);
+  g_string_append_printf(record, "- %" G_GUINT64_FORMAT "\n", id);
+  journal_append(record);
+  g_string_free(record, TRUE);
+
+  compact_maybe();
+}
+
+void journal_endpoint_acknowledged(guint64 id, guint endpoint) {
+  GString *record;
+
+  if (journal.fd < 0)
+    return;
+
+  record = g_string_sized_new(32);
+  g_string_append_printf(record, "~ %" G_GUINT64_FORMAT " %u\n", id,
+                         endpoint);
+  journal_append(record);
+  g_string_free(record, TRUE);
+
+  compact_maybe();
+}
+
+void journal_checkpoint(void) {
+  journal_sync();
+  compact_maybe();
+}
+
+void journal_get_stats(journal_stats *stats) {
+  stats->records = journal.records;
+  stats->written = journal.written;
+  stats->sync_time = journal.sync_time;
+}
+
+/**
+ * Write a record to the journal (and the journal that will replace it
+ * after compaction) and sync according to the configured policy
+ */
+static void journal_append(GString *record) {
+  if (!write_all(journal.fd, record->str, record->len)) {
+    g_warning("Failed to write to journal: %s", g_strerror(errno));
+    return;
+  }
+  journal.records++;
+  journal.written += record->len;
+  journal.dirty = TRUE;
+
+  if (journal.writer) {
+    g_string_append_len(journal.pending, record->str, record->len);
+    journal.compact_records++;
+  }
+
+  switch (prefs.cache_sync) {
+  case SYNC_ALWAYS:
+    journal_sync();
+    break;
+  case SYNC_BATCH:
+    // one fsync covers everything written until the timeout fires
+    if (journal.sync_source == 0)
+      journal.sync_source = g_timeout_add_seconds(
+          prefs.cache_sync_delay, journal_sync_timeout, NULL);
+    break;
+  case SYNC_NEVER:
+    break;
+  }
+}
+
+/**
+ * Flush the journal to disk if anything was written since the last sync
+ */
+static void journal_sync(void) {
+  gint64 start;
+
+  if (!journal.dirty || journal.fd < 0)
+    return;
+
+  start = g_get_monotonic_time();
+  if (fsync(journal.fd) < 0)
+    g_warning("Failed to sync journal: %s", g_strerror(errno));
+  metrics_observe(&journal.sync_time, g_get_monotonic_time() - start);
+  journal.dirty = FALSE;
+}
+
+static gboolean journal_sync_timeout(G_GNUC_UNUSED gpointer data) {
+  count_wakeup(WAKEUP_JOURNAL_SYNC);
+  journal.sync_source = 0;
+  journal_sync();
+  return FALSE;
+}
+
+/**
+ * Start compacting in the background once the journal has grown larger
+ * than the queue it describes
+ */
+static void compact_maybe(void) {
+  guint live = queue_get_length();
+
+  if (journal.writer || journal.records < COMPACT_MIN_RECORDS ||
+      journal.records <= live)
+    return;
+
+  scmpc_debug("Compacting journal: %u records, %u songs queued.",
+              journal.records, live);
+  if (compact_start())
+    journal.compact_source = g_idle_add(compact_idle, NULL);
+}
+
+/**
+ * Start writing a new snapshot. Songs that are in the queue now are copied
+ * over in chunks, records written in the meantime are kept in pending and
+ * become the new journal once the snapshot is in place.
+ */
+static gboolean compact_start(void) {
+  queue_node *last = queue_peek_nth(queue_get_length() - 1);
+
+  journal.writer = cache_writer_new(prefs.cache_file);
+  if (!journal.writer)
+    return FALSE;
+
+  journal.compact_cursor = 0;
+  journal.compact_end = (last ? last->id + 1 : 0);
+  journal.compact_records = 0;
+  journal.pending = g_string_new(JOURNAL_HEADER);
+  for (guint i = 0; i < prefs.as_count; i++) {
+    gchar *key = queue_endpoint_key(i);
+    g_string_append_printf(journal.pending, "@ %u ", i);
+    append_escaped(journal.pending, key);
+    g_string_append_c(journal.pending, '\n');
+    g_free(key);
+  }
+  return TRUE;
+}
+
+/**
+ * Copy the next chunk of songs to the snapshot, returns FALSE once
+ * compaction is finished
+ */
+static gboolean compact_step(void) {
+  queue_view view;
+  guint count;
+
+  if (!journal.writer)
+    return FALSE;
+
+  count = queue_peek_range(queue_find_id(journal.compact_cursor),
+                           COMPACT_CHUNK, &view);
+
+  for (guint i = 0; i < count; i++) {
+    queue_node *song = queue_view_nth(&view, i);
+    if (song->id >= journal.compact_end) {
+      count = i;
+      break;
+    }
+    if (!cache_writer_add(journal.writer, song)) {
+      compact_abort();
+      return FALSE;
+    }
+    journal.compact_cursor = song->id + 1;
+  }
+
+  if (count == COMPACT_CHUNK)
+    return TRUE;
+
+  compact_finish();
+  return FALSE;
+}
+
+/**
+ * Move the snapshot into place and replace the journal with the records
+ * written during compaction. If we die in between, replaying the old
+ * journal on top of the new snapshot gives the same queue.
+ */
+static void compact_finish(void) {
+  gchar *tmp_filename = g_strconcat(journal.filename, ".tmp", NULL);
+  gint fd;
+
+  if (!cache_writer_commit(journal.writer)) {
+    journal.writer = NULL;
+    compact_abort();
+    g_free(tmp_filename);
+    return;
+  }
+  journal.writer = NULL;
+
+  fd = open(tmp_filename, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || !write_all(fd, journal.pending->str, journal.pending->len) ||
+      fsync(fd) < 0 || rename(tmp_filename, journal.filename) < 0) {
+    g_warning("Failed to replace journal: %s", g_strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp_filename);
+    }
+    compact_abort();
+    g_free(tmp_filename);
+    return;
+  }
+  g_free(tmp_filename);
+
+  if (journal.fd >= 0)
+    close(journal.fd);
+  journal.fd = fd;
+  journal.records = journal.compact_records;
+  journal.dirty = FALSE;
+
+  g_string_free(journal.pending, TRUE);
+  journal.pending = NULL;
+  scmpc_debug("Journal compacted to %u records.", journal.records);
+}
+
+/**
+ * Throw away a failed compaction, the old journal stays in place
+ */
+static void compact_abort(void) {
+  if (journal.writer)
+    cache_writer_abort(journal.writer);
+  journal.writer = NULL;
+
+  if (journal.pending)
+    g_string_free(journal.pending, TRUE);
+  journal.pending = NULL;
+}
+
+static gboolean compact_idle(G_GNUC_UNUSED gpointer data) {
+  count_wakeup(WAKEUP_JOURNAL_COMPACT);
+  if (compact_step())
+    return TRUE;
+
+  journal.compact_source = 0;
+  return FALSE;
+}
+
+/**
+ * Format a "+" record
+ */
+static void format_enqueued(GString *buf, const queue_node *song) {
+  g_string_append_printf(buf,
+                         "+ %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %u %u ",
+                         song->id, song->date, song->length, song->track);
+  append_escaped(buf, song->artist);
+  g_string_append_c(buf, '\t');
+  append_escaped(buf, song->title);
+  g_string_append_c(buf, '\t');
+  append_escaped(buf, song->album);
+  g_string_append_c(buf, '\n');
+}
+
+/**
+ * Append str to buf, escaping the characters that delimit records
+ */
+static void append_escaped(GString *buf, const gchar *str) {
+  for (; *str; str++) {
+    switch (*str) {
+    case '\\':
+      g_string_append(buf, "\\\\");
+      break;
+    case '\t':
+      g_string_append(buf, "\\t");
+      break;
+    case '\n':
+      g_string_append(buf, "\\n");
+      break;
+    case '\r':
+      g_string_append(buf, "\\r");
+      break;
+    default:
+      g_string_append_c(buf, *str);
+    }
+  }
+}
+
+/**
+ * Undo #append_escaped in place
+ */
+static void unescape(gchar *str) {
+  gchar *out = str;
+
+  for (; *str; str++) {
+    if (*str != '\\' || !str[1]) {
+      *out++ = *str;
+      continue;
+    }
+
+    switch (*++str) {
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    default:
+      *out++ = *str;
+    }
+  }
+  *out = '\0';
+}
+
+/**
+ * write() that retries on short writes and EINTR
+ */
+static gboolean write_all(gint fd, const gchar *buf, gsize len) {
+  while (len > 0) {
+    gssize ret = write(fd, buf, len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return FALSE;
+    buf += ret;
+    len -= ret;
+  }
+  return TRUE;
+}
@@ -0,0 +1,93 @@
+/**
+ * journal.h: Append-only journal of queue changes.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_JOURNAL_H
+#define HAVE_JOURNAL_H
+
+#include <glib.h>
+
+#include "metrics.h"
+#include "queue.h"
+
+/**
+ * When to fsync the journal
+ */
+typedef enum { SYNC_ALWAYS, SYNC_BATCH, SYNC_NEVER } sync_policy;
+
+/**
+ * Journal activity since startup
+ */
+typedef struct {
+  /* records in the current journal */
+  guint records;
+  guint64 written;
+  metrics_histogram sync_time;
+} journal_stats;
+
+/**
+ * Replay the journal into the queue. Returns FALSE if there is no journal.
+ */
+gboolean journal_replay(void);
+
+/**
+ * Open the journal for appending. If rewrite is set or the journal doesn't
+ * exist yet, a snapshot of the queue is written first and the journal
+ * starts out empty.
+ */
+gboolean journal_open(gboolean rewrite);
+
+/**
+ * Finish a running compaction, sync and close the journal
+ */
+void journal_close(void);
+
+/**
+ * Record a song that was added to the queue
+ */
+void journal_enqueued(const queue_node *song);
+
+/**
+ * Record a song that was removed from the queue
+ */
+void journal_acknowledged(guint64 id);
+
+/**
+ * Record a song that one of several endpoints has acknowledged, while it
+ * stays queued for the others
+ */
+void journal_endpoint_acknowledged(guint64 id, guint endpoint);
+
+/**
+ * Sync the journal to disk and fold it into a new snapshot if it has
+ * grown larger than the queue
+ */
+void journal_checkpoint(void);
+
+/**
+ * Copy the journal statistics to stats
+ */
+void journal_get_stats(journal_stats *stats);
+
+#endif /* HAVE_JOURNAL_H */
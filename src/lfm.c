@@ -0,0 +1,272 @@
+/**
+ * lfm.c: Last.fm web service requests and responses.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lfm.h"
+#include "log.h"
+
+/**
+ * Elements whose text we keep
+ */
+typedef enum { TEXT_NONE, TEXT_ERROR, TEXT_KEY } text_target;
+
+/**
+ * Parser state
+ */
+typedef struct {
+  lfm_response *response;
+  gboolean in_lfm;
+  gboolean in_session;
+  gboolean in_now_playing;
+  gboolean in_scrobble;
+  text_target text;
+} parse_state;
+
+static void start_element(GMarkupParseContext *context,
+                          const gchar *element_name,
+                          const gchar **attribute_names,
+                          const gchar **attribute_values, gpointer user_data,
+                          GError **error);
+static void end_element(GMarkupParseContext *context,
+                        const gchar *element_name, gpointer user_data,
+                        GError **error);
+static void text(GMarkupParseContext *context, const gchar *text, gsize len,
+                 gpointer user_data, GError **error);
+static const gchar *get_attribute(const gchar **names, const gchar **values,
+                                  const gchar *name);
+static guint get_uint_attribute(const gchar **names, const gchar **values,
+                                const gchar *name);
+
+static const GMarkupParser parser = {start_element, end_element, text, NULL,
+                                     NULL};
+
+const gchar *lfm_build_now_playing(request *req, const gchar *api_key,
+                                   const gchar *session_key,
+                                   const gchar *secret,
+                                   const lfm_track *track) {
+  request_start(req, NULL);
+  request_add(req, "api_key", api_key);
+  request_add(req, "method", "track.updateNowPlaying");
+  request_add(req, "sk", session_key);
+  request_add(req, "album", track->album);
+  request_add(req, "artist", track->artist);
+  request_add_uint(req, "duration", track->length);
+  request_add(req, "track", track->title);
+  if (track->track > 0)
+    request_add_uint(req, "trackNumber", track->track);
+  return request_finish(req, secret);
+}
+
+const gchar *lfm_build_scrobble_single(request *req, const gchar *api_key,
+                                       const gchar *session_key,
+                                       const gchar *secret,
+                                       const lfm_track *track) {
+  request_start(req, NULL);
+  request_add(req, "api_key", api_key);
+  request_add(req, "method", "track.scrobble");
+  request_add(req, "sk", session_key);
+  request_add(req, "album", track->album);
+  request_add(req, "artist", track->artist);
+  request_add_uint(req, "duration", track->length);
+  request_add_uint(req, "timestamp", track->date);
+  request_add(req, "track", track->title);
+  if (track->track > 0)
+    request_add_uint(req, "trackNumber", track->track);
+  return request_finish(req, secret);
+}
+
+const gchar *lfm_build_scrobble_multi(request *req, const gchar *api_key,
+                                      const gchar *session_key,
+                                      const gchar *secret,
+                                      const lfm_track *tracks, guint num) {
+  request_start(req, NULL);
+  request_add(req, "api_key", api_key);
+  request_add(req, "method", "track.scrobble");
+  request_add(req, "sk", session_key);
+
+  for (guint i = 0; i < num; i++) {
+    const lfm_track *track = &tracks[i];
+
+    request_add_item(req, "album", i, track->album);
+    request_add_item(req, "artist", i, track->artist);
+    request_add_item_uint(req, "duration", i, track->length);
+    request_add_item_uint(req, "timestamp", i, track->date);
+    request_add_item(req, "track", i, track->title);
+    if (track->track > 0)
+      request_add_item_uint(req, "trackNumber", i, track->track);
+  }
+  return request_finish(req, secret);
+}
+
+gboolean lfm_parse(const gchar *data, gsize length, lfm_response *response) {
+  GMarkupParseContext *context;
+  parse_state state = {response, FALSE, FALSE, FALSE, FALSE, TEXT_NONE};
+  GError *error = NULL;
+
+  memset(response, 0, sizeof(lfm_response));
+  response->status = LFM_INVALID;
+
+  context = g_markup_parse_context_new(&parser, 0, &state, NULL);
+  if (!g_markup_parse_context_parse(context, data, length, &error) ||
+      !g_markup_parse_context_end_parse(context, &error)) {
+    scmpc_trace("Malformed response: %s", error->message);
+    g_error_free(error);
+    response->status = LFM_INVALID;
+  }
+  g_markup_parse_context_free(context);
+
+  return response->status != LFM_INVALID;
+}
+
+void lfm_response_clear(lfm_response *response) {
+  g_free(response->error_message);
+  g_free(response->session_key);
+  response->error_message = NULL;
+  response->session_key = NULL;
+}
+
+static void start_element(G_GNUC_UNUSED GMarkupParseContext *context,
+                          const gchar *element_name,
+                          const gchar **attribute_names,
+                          const gchar **attribute_values, gpointer user_data,
+                          G_GNUC_UNUSED GError **error) {
+  parse_state *state = user_data;
+  lfm_response *response = state->response;
+  const gchar *status;
+
+  if (!strcmp(element_name, "lfm")) {
+    status = get_attribute(attribute_names, attribute_values, "status");
+    if (status && !strcmp(status, "ok"))
+      response->status = LFM_OK;
+    else if (status && !strcmp(status, "failed"))
+      response->status = LFM_FAILED;
+    state->in_lfm = TRUE;
+    return;
+  }
+
+  if (!state->in_lfm)
+    return;
+
+  if (!strcmp(element_name, "error")) {
+    response->error_code =
+        get_uint_attribute(attribute_names, attribute_values, "code");
+    state->text = TEXT_ERROR;
+  } else if (!strcmp(element_name, "session")) {
+    state->in_session = TRUE;
+  } else if (!strcmp(element_name, "key") && state->in_session) {
+    state->text = TEXT_KEY;
+  } else if (!strcmp(element_name, "nowplaying")) {
+    state->in_now_playing = TRUE;
+  } else if (!strcmp(element_name, "scrobbles")) {
+    response->accepted =
+        get_uint_attribute(attribute_names, attribute_values, "accepted");
+    response->ignored =
+        get_uint_attribute(attribute_names, attribute_values, "ignored");
+  } else if (!strcmp(element_name, "scrobble")) {
+    state->in_scrobble = TRUE;
+    response->num_scrobbles++;
+  } else if (!strcmp(element_name, "ignoredMessage")) {
+    lfm_ignored code =
+        get_uint_attribute(attribute_names, attribute_values, "code");
+    guint n = response->num_scrobbles;
+
+    if (state->in_scrobble && n <= LFM_MAX_SCROBBLES)
+      response->scrobbles[n - 1] = code;
+    else if (state->in_now_playing)
+      response->now_playing = code;
+  }
+}
+
+static void end_element(G_GNUC_UNUSED GMarkupParseContext *context,
+                        const gchar *element_name, gpointer user_data,
+                        G_GNUC_UNUSED GError **error) {
+  parse_state *state = user_data;
+
+  if (state->text == TEXT_ERROR && state->response->error_message)
+    g_strstrip(state->response->error_message);
+  else if (state->text == TEXT_KEY && state->response->session_key)
+    g_strstrip(state->response->session_key);
+  state->text = TEXT_NONE;
+
+  if (!strcmp(element_name, "lfm"))
+    state->in_lfm = FALSE;
+  else if (!strcmp(element_name, "session"))
+    state->in_session = FALSE;
+  else if (!strcmp(element_name, "nowplaying"))
+    state->in_now_playing = FALSE;
+  else if (!strcmp(element_name, "scrobble"))
+    state->in_scrobble = FALSE;
+}
+
+static void text(G_GNUC_UNUSED GMarkupParseContext *context, const gchar *text,
+                 gsize len, gpointer user_data, G_GNUC_UNUSED GError **error) {
+  parse_state *state = user_data;
+  gchar **target, *tmp;
+
+  switch (state->text) {
+  case TEXT_ERROR:
+    target = &state->response->error_message;
+    break;
+  case TEXT_KEY:
+    target = &state->response->session_key;
+    break;
+  default:
+    return;
+  }
+
+  // text may arrive in pieces
+  tmp = g_strndup(text, len);
+  if (*target) {
+    gchar *joined = g_strconcat(*target, tmp, NULL);
+    g_free(tmp);
+    tmp = joined;
+  }
+  g_free(*target);
+  *target = tmp;
+}
+
+/**
+ * Look up an attribute by name, returns NULL if it's missing
+ */
+static const gchar *get_attribute(const gchar **names, const gchar **values,
+                                  const gchar *name) {
+  for (; *names; names++, values++) {
+    if (!strcmp(*names, name))
+      return *values;
+  }
+  return NULL;
+}
+
+/**
+ * Look up a numeric attribute, missing attributes count as 0
+ */
+static guint get_uint_attribute(const gchar **names, const gchar **values,
+                                const gchar *name) {
+  const gchar *value = get_attribute(names, values, name);
+
+  return (value ? strtoul(value, NULL, 10) : 0);
+}
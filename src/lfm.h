@@ -0,0 +1,128 @@
+/**
+ * lfm.h: Last.fm web service requests and responses.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_LFM_H
+#define HAVE_LFM_H
+
+#include <glib.h>
+
+#include "request.h"
+
+/**
+ * Most scrobbles Last.fm accepts in a single request
+ */
+#define LFM_MAX_SCROBBLES 50
+
+/**
+ * Reasons for Last.fm to ignore a scrobble or Now Playing notification
+ */
+typedef enum {
+  LFM_IGNORED_NONE = 0,
+  LFM_IGNORED_ARTIST = 1,
+  LFM_IGNORED_TRACK = 2,
+  LFM_IGNORED_TOO_OLD = 3,
+  LFM_IGNORED_TOO_NEW = 4,
+  LFM_IGNORED_DAILY_LIMIT = 5
+} lfm_ignored;
+
+/**
+ * Whether a scrobble ignored for this reason should be sent again later
+ */
+#define LFM_IGNORED_RETRYABLE(code) ((code) == LFM_IGNORED_DAILY_LIMIT)
+
+/**
+ * The parts of a response scmpc cares about
+ */
+typedef struct {
+  enum { LFM_INVALID, LFM_OK, LFM_FAILED } status;
+  /* status="failed" */
+  gint error_code;
+  gchar *error_message;
+  /* auth.getMobileSession */
+  gchar *session_key;
+  /* track.updateNowPlaying */
+  lfm_ignored now_playing;
+  /* track.scrobble */
+  guint accepted;
+  guint ignored;
+  guint num_scrobbles;
+  lfm_ignored scrobbles[LFM_MAX_SCROBBLES];
+} lfm_response;
+
+/**
+ * A song in a Now Playing notification or scrobble. The id is scmpc's own
+ * queue id, it isn't sent.
+ */
+typedef struct {
+  guint64 id;
+  gchar *artist;
+  gchar *album;
+  gchar *title;
+  gint64 date;
+  guint length;
+  guint track;
+} lfm_track;
+
+/**
+ * Build a track.updateNowPlaying request for track in req and return it,
+ * signed with secret
+ */
+const gchar *lfm_build_now_playing(request *req, const gchar *api_key,
+                                   const gchar *session_key,
+                                   const gchar *secret,
+                                   const lfm_track *track);
+
+/**
+ * Build a track.scrobble request for a single track
+ */
+const gchar *lfm_build_scrobble_single(request *req, const gchar *api_key,
+                                       const gchar *session_key,
+                                       const gchar *secret,
+                                       const lfm_track *track);
+
+/**
+ * Build a track.scrobble request for num tracks, using array notation
+ */
+const gchar *lfm_build_scrobble_multi(request *req, const gchar *api_key,
+                                      const gchar *session_key,
+                                      const gchar *secret,
+                                      const lfm_track *tracks, guint num);
+
+/**
+ * Parse length bytes of response data into response. Returns FALSE and
+ * sets the status to LFM_INVALID if it isn't a well-formed response.
+ *
+ * The whole response is parsed at once on purpose: it is a few kilobytes
+ * at most, cURL collects it into a pooled buffer anyway, and that buffer
+ * is what gets logged when the response can't be parsed.
+ */
+gboolean lfm_parse(const gchar *data, gsize length, lfm_response *response);
+
+/**
+ * Free the strings of a parsed response
+ */
+void lfm_response_clear(lfm_response *response);
+
+#endif /* HAVE_LFM_H */
@@ -0,0 +1,320 @@
+/**
+ * log.c: Buffered log file.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "preferences.h"
+
+/**
+ * Size of the message ring in bytes, a power of two. Messages that don't
+ * fit are dropped and counted.
+ */
+#define LOG_BUFFER_SIZE 65536
+
+/**
+ * Milliseconds a message may wait in the ring before it is written
+ */
+#define LOG_FLUSH_INTERVAL 500
+
+/**
+ * Buffered bytes that wake the writer up early
+ */
+#define LOG_FLUSH_BYTES (LOG_BUFFER_SIZE / 2)
+
+/**
+ * Length of the timestamp prefix, "%Y-%m-%d %H:%M:%S  "
+ */
+#define STAMP_SIZE 21
+
+static void log_append(const gchar *data, gsize len);
+static void log_write(const gchar *data, gsize len);
+static void log_stamp(void);
+static gboolean log_reopen_file(void);
+static gpointer log_writer(gpointer data);
+
+/**
+ * Logger state. Messages are appended at head under the lock, the writer
+ * owns everything between tail and head and moves tail once it is
+ * written, so it doesn't need the lock while writing.
+ */
+static struct {
+  GMutex lock;
+  /* signals the writer */
+  GCond wakeup;
+  /* signals threads waiting in flush_log() */
+  GCond written;
+  FILE *file;
+  gchar *filename;
+  GThread *thread;
+  gboolean stopping;
+  gboolean urgent;
+  gboolean reopen;
+  gchar ring[LOG_BUFFER_SIZE];
+  guint64 head;
+  guint64 tail;
+  guint64 dropped;
+  guint64 dropped_reported;
+  /* timestamp prefix, formatted once per second */
+  gint64 stamp_time;
+  gchar stamp[STAMP_SIZE + 1];
+} logger;
+
+void open_log(const gchar *filename) {
+  logger.stamp_time = -1;
+  if (!prefs.fork) {
+    logger.file = stdout;
+    return;
+  }
+
+  logger.filename = g_strdup(filename);
+  logger.file = fopen(filename, "a");
+  if (!logger.file) {
+    fputs("Unable to open log file for writing,"
+          " logging to stdout\n",
+          stderr);
+    logger.file = stdout;
+  }
+}
+
+void start_log_writer(void) {
+  g_mutex_lock(&logger.lock);
+  if (!logger.thread) {
+    logger.stopping = FALSE;
+    logger.thread = g_thread_new("log", log_writer, NULL);
+  }
+  g_mutex_unlock(&logger.lock);
+}
+
+void stop_log_writer(void) {
+  GThread *thread;
+
+  g_mutex_lock(&logger.lock);
+  thread = logger.thread;
+  logger.stopping = TRUE;
+  g_cond_signal(&logger.wakeup);
+  g_mutex_unlock(&logger.lock);
+
+  // the writer empties the ring before it exits
+  if (thread)
+    g_thread_join(thread);
+}
+
+void flush_log(void) {
+  guint64 head;
+
+  g_mutex_lock(&logger.lock);
+  head = logger.head;
+  if (logger.thread) {
+    logger.urgent = TRUE;
+    g_cond_signal(&logger.wakeup);
+    while (logger.tail < head && logger.thread)
+      g_cond_wait(&logger.written, &logger.lock);
+  }
+  g_mutex_unlock(&logger.lock);
+}
+
+void reopen_log(void) {
+  g_mutex_lock(&logger.lock);
+  if (logger.thread) {
+    logger.reopen = TRUE;
+    g_cond_signal(&logger.wakeup);
+  } else {
+    log_reopen_file();
+  }
+  g_mutex_unlock(&logger.lock);
+}
+
+guint64 log_get_dropped(void) {
+  guint64 dropped;
+
+  g_mutex_lock(&logger.lock);
+  dropped = logger.dropped;
+  g_mutex_unlock(&logger.lock);
+  return dropped;
+}
+
+void scmpc_log(G_GNUC_UNUSED const gchar *log_domain, GLogLevelFlags log_level,
+               const gchar *message, G_GNUC_UNUSED gpointer user_data) {
+  gsize len = strlen(message);
+  gboolean fatal = (log_level & G_LOG_LEVEL_ERROR) != 0;
+
+  if ((log_level & G_LOG_LEVEL_MASK) > prefs.log_level)
+    return;
+
+  g_mutex_lock(&logger.lock);
+  log_stamp();
+
+  if (!logger.thread) {
+    log_write(logger.stamp, STAMP_SIZE);
+    log_write(message, len);
+    log_write("\n", 1);
+    fflush(logger.file);
+    g_mutex_unlock(&logger.lock);
+    return;
+  }
+
+  if (logger.head - logger.tail + STAMP_SIZE + len + 1 > LOG_BUFFER_SIZE) {
+    logger.dropped++;
+    g_mutex_unlock(&logger.lock);
+    return;
+  }
+
+  // the writer sleeps while the ring is empty
+  if (logger.head == logger.tail || fatal ||
+      logger.head - logger.tail >= LOG_FLUSH_BYTES)
+    g_cond_signal(&logger.wakeup);
+  if (fatal)
+    logger.urgent = TRUE;
+
+  log_append(logger.stamp, STAMP_SIZE);
+  log_append(message, len);
+  log_append("\n", 1);
+  g_mutex_unlock(&logger.lock);
+
+  // g_error() aborts once we return
+  if (fatal)
+    flush_log();
+}
+
+/**
+ * Copy data to the ring at head, the caller has checked that it fits
+ */
+static void log_append(const gchar *data, gsize len) {
+  gsize pos = logger.head & (LOG_BUFFER_SIZE - 1);
+  gsize first = MIN(len, LOG_BUFFER_SIZE - pos);
+
+  memcpy(logger.ring + pos, data, first);
+  memcpy(logger.ring, data + first, len - first);
+  logger.head += len;
+}
+
+static void log_write(const gchar *data, gsize len) {
+  if (fwrite(data, 1, len, logger.file) < len)
+    clearerr(logger.file);
+}
+
+/**
+ * Format the timestamp prefix if the second has changed since the last
+ * message
+ */
+static void log_stamp(void) {
+  time_t now = time(NULL);
+  struct tm tm;
+
+  if (now == logger.stamp_time)
+    return;
+
+  logger.stamp_time = now;
+  localtime_r(&now, &tm);
+  if (strftime(logger.stamp, sizeof(logger.stamp), "%Y-%m-%d %H:%M:%S  ",
+               &tm) != STAMP_SIZE)
+    memset(logger.stamp, ' ', STAMP_SIZE);
+}
+
+/**
+ * Open the log file again so that a rotated one is let go, the old file
+ * is kept if that fails
+ */
+static gboolean log_reopen_file(void) {
+  FILE *file;
+
+  if (!logger.filename || logger.file == stdout)
+    return TRUE;
+
+  file = fopen(logger.filename, "a");
+  if (!file)
+    return FALSE;
+
+  fclose(logger.file);
+  logger.file = file;
+  return TRUE;
+}
+
+/**
+ * Write what the ring holds at most #LOG_FLUSH_INTERVAL after the first
+ * message came in, or earlier when it fills up or is asked to
+ */
+static gpointer log_writer(G_GNUC_UNUSED gpointer data) {
+  gchar notice[64];
+
+  g_mutex_lock(&logger.lock);
+  for (;;) {
+    gboolean reopen, reopened = TRUE;
+    guint64 head, tail, dropped;
+    gint64 deadline;
+    gsize pos, len;
+
+    while (logger.head == logger.tail && !logger.stopping && !logger.reopen)
+      g_cond_wait(&logger.wakeup, &logger.lock);
+
+    deadline = g_get_monotonic_time() + LOG_FLUSH_INTERVAL * 1000;
+    while (!logger.stopping && !logger.reopen && !logger.urgent &&
+           logger.head - logger.tail < LOG_FLUSH_BYTES)
+      if (!g_cond_wait_until(&logger.wakeup, &logger.lock, deadline))
+        break;
+
+    head = logger.head;
+    tail = logger.tail;
+    reopen = logger.reopen;
+    dropped = logger.dropped - logger.dropped_reported;
+    logger.dropped_reported = logger.dropped;
+    logger.reopen = FALSE;
+    logger.urgent = FALSE;
+    if (dropped > 0)
+      g_snprintf(notice, sizeof(notice),
+                 "%.*s%" G_GUINT64_FORMAT " log messages dropped.\n",
+                 STAMP_SIZE, logger.stamp, dropped);
+    g_mutex_unlock(&logger.lock);
+
+    // the producers don't touch anything between tail and head
+    if (reopen)
+      reopened = log_reopen_file();
+    pos = tail & (LOG_BUFFER_SIZE - 1);
+    len = head - tail;
+    log_write(logger.ring + pos, MIN(len, LOG_BUFFER_SIZE - pos));
+    if (len > LOG_BUFFER_SIZE - pos)
+      log_write(logger.ring, len - (LOG_BUFFER_SIZE - pos));
+    if (dropped > 0)
+      log_write(notice, strlen(notice));
+    fflush(logger.file);
+
+    if (!reopened)
+      g_critical("Unable to reopen log file %s", logger.filename);
+
+    g_mutex_lock(&logger.lock);
+    logger.tail = head;
+    g_cond_broadcast(&logger.written);
+    if (logger.stopping && logger.head == logger.tail)
+      break;
+  }
+  // later messages are written directly
+  logger.thread = NULL;
+  g_cond_broadcast(&logger.written);
+  g_mutex_unlock(&logger.lock);
+  return NULL;
+}
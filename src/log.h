@@ -0,0 +1,100 @@
+/**
+ * log.h: Buffered log file.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_LOG_H
+#define HAVE_LOG_H
+
+#include <glib.h>
+
+#include "preferences.h"
+
+/**
+ * Whether messages of a level are written to the log
+ */
+#define log_enabled(level) ((level) <= prefs.log_level)
+
+/**
+ * Like g_debug(), but the arguments are only evaluated and formatted if
+ * debug messages are logged
+ */
+#define scmpc_debug(...)                                                      \
+  do {                                                                        \
+    if (log_enabled(G_LOG_LEVEL_DEBUG))                                       \
+      g_debug(__VA_ARGS__);                                                   \
+  } while (0)
+
+/**
+ * Debug messages on the submission path, such as request and response
+ * dumps. Configuring with --disable-trace-log leaves them out entirely.
+ */
+#ifdef NO_TRACE_LOG
+#define scmpc_trace(...)                                                      \
+  do {                                                                        \
+  } while (0)
+#else
+#define scmpc_trace(...) scmpc_debug(__VA_ARGS__)
+#endif
+
+/**
+ * Open the log file for writing. Messages are written as they come in
+ * until #start_log_writer is called.
+ */
+void open_log(const gchar *filename);
+
+/**
+ * Start the writer thread, from now on messages are buffered and written
+ * in the background. Threads don't survive fork(), so this has to be
+ * called after daemonising.
+ */
+void start_log_writer(void);
+
+/**
+ * Write everything buffered and stop the writer thread, later messages
+ * are written as they come in again
+ */
+void stop_log_writer(void);
+
+/**
+ * Wait until everything buffered so far is written
+ */
+void flush_log(void);
+
+/**
+ * Reopen the log file after it was rotated
+ */
+void reopen_log(void);
+
+/**
+ * Return the number of messages dropped because the buffer was full
+ */
+guint64 log_get_dropped(void);
+
+/**
+ * GLib logging handler, should not be called directly
+ */
+void scmpc_log(const gchar *log_domain, GLogLevelFlags log_level,
+               const gchar *message, gpointer user_data);
+
+#endif /* HAVE_LOG_H */
@@ -0,0 +1,488 @@
+/**
+ * metrics.c: Runtime metrics on a local stats socket.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "audioscrobbler.h"
+#include "cache.h"
+#include "http.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+#include "misc.h"
+#include "mpd.h"
+#include "preferences.h"
+#include "queue.h"
+#include "strpool.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Every connection to the socket gets the current metrics in the
+ * Prometheus text format and is closed, e.g.
+ *
+ *   socat -u UNIX-CONNECT:/run/scmpc/stats.sock -
+ *
+ * Counters live in the modules they describe and are only collected here
+ * when someone asks, so keeping them costs an increment or a histogram
+ * bucket on the paths they measure.
+ */
+
+static gboolean metrics_accept(GIOChannel *source, GIOCondition condition,
+                               gpointer data);
+static void metrics_collect(GString *out);
+static void collect_queue(GString *out);
+static void collect_endpoints(GString *out);
+static void collect_mpd(GString *out);
+static void collect_storage(GString *out);
+static void collect_http(GString *out);
+static void collect_wakeups(GString *out);
+static void put_header(GString *out, const gchar *name, const gchar *type,
+                       const gchar *help);
+static void put_sample(GString *out, const gchar *name, const gchar *labels,
+                       const gchar *extra, gdouble value);
+static void put_histogram(GString *out, const gchar *name,
+                          const gchar *labels, const metrics_histogram *h);
+static gchar *make_label(const gchar *name, const gchar *value);
+
+/**
+ * Listening socket state
+ */
+static struct {
+  gint fd;
+  guint source;
+  /* reused for every client */
+  GString *buf;
+} metrics = {.fd = -1};
+
+/**
+ * Label values of the main loop wakeup sources
+ */
+static const gchar *const wakeup_names[WAKEUP_SOURCES] = {
+    [WAKEUP_SIGNAL] = "signal",
+    [WAKEUP_STATS] = "stats",
+    [WAKEUP_MPD_IDLE] = "mpd_idle",
+    [WAKEUP_MPD_CHECK] = "mpd_check",
+    [WAKEUP_MPD_RECONNECT] = "mpd_reconnect",
+    [WAKEUP_AS_RETRY] = "as_retry",
+    [WAKEUP_AS_FLUSH] = "as_flush",
+    [WAKEUP_WORKER] = "worker",
+    [WAKEUP_CACHE_SAVE] = "cache_save",
+    [WAKEUP_JOURNAL_SYNC] = "journal_sync",
+    [WAKEUP_JOURNAL_COMPACT] = "journal_compact",
+};
+
+void metrics_init(void) {
+  struct sockaddr_un addr;
+  struct stat st;
+  GIOChannel *channel;
+
+  if (!prefs.stats_socket || !strlen(prefs.stats_socket))
+    return;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(prefs.stats_socket) >= sizeof(addr.sun_path)) {
+    g_warning("Stats socket path is too long: %s", prefs.stats_socket);
+    return;
+  }
+  g_strlcpy(addr.sun_path, prefs.stats_socket, sizeof(addr.sun_path));
+
+  // a socket left behind by an instance that didn't exit cleanly
+  if (lstat(prefs.stats_socket, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(prefs.stats_socket);
+
+  metrics.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (metrics.fd < 0 ||
+      bind(metrics.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(metrics.fd, 4) < 0) {
+    g_warning("Failed to open stats socket %s: %s", prefs.stats_socket,
+              g_strerror(errno));
+    if (metrics.fd >= 0)
+      close(metrics.fd);
+    metrics.fd = -1;
+    return;
+  }
+  fcntl(metrics.fd, F_SETFL, O_NONBLOCK);
+
+  metrics.buf = g_string_sized_new(8192);
+  channel = g_io_channel_unix_new(metrics.fd);
+  metrics.source = g_io_add_watch(channel, G_IO_IN, metrics_accept, NULL);
+  g_io_channel_unref(channel);
+  scmpc_debug("Serving metrics on %s", prefs.stats_socket);
+}
+
+void metrics_cleanup(void) {
+  if (metrics.fd < 0)
+    return;
+
+  if (metrics.source > 0)
+    g_source_remove(metrics.source);
+  metrics.source = 0;
+  close(metrics.fd);
+  metrics.fd = -1;
+  unlink(prefs.stats_socket);
+  g_string_free(metrics.buf, TRUE);
+  metrics.buf = NULL;
+}
+
+/**
+ * Send the metrics to a new client and hang up. The client is never waited
+ * for, if it doesn't take everything at once it gets nothing.
+ */
+static gboolean metrics_accept(G_GNUC_UNUSED GIOChannel *source,
+                               G_GNUC_UNUSED GIOCondition condition,
+                               G_GNUC_UNUSED gpointer data) {
+  gint client = accept(metrics.fd, NULL, NULL);
+  gssize sent;
+
+  count_wakeup(WAKEUP_STATS);
+  if (client < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      g_warning("Failed to accept stats client: %s", g_strerror(errno));
+    return TRUE;
+  }
+
+  g_string_truncate(metrics.buf, 0);
+  metrics_collect(metrics.buf);
+
+  fcntl(client, F_SETFL, O_NONBLOCK);
+  sent = send(client, metrics.buf->str, metrics.buf->len, MSG_NOSIGNAL);
+  if (sent < (gssize)metrics.buf->len)
+    scmpc_debug("Stats client didn't take %" G_GSIZE_FORMAT " bytes.",
+                metrics.buf->len);
+  close(client);
+  return TRUE;
+}
+
+/**
+ * Format all metrics
+ */
+static void metrics_collect(GString *out) {
+  collect_queue(out);
+  collect_endpoints(out);
+  collect_mpd(out);
+  collect_storage(out);
+  collect_http(out);
+  collect_wakeups(out);
+}
+
+static void collect_queue(GString *out) {
+  queue_node *oldest = queue_peek_head();
+
+  put_header(out, "scmpc_queue_length", "gauge",
+             "Songs waiting for at least one endpoint");
+  put_sample(out, "scmpc_queue_length", NULL, NULL, queue_get_length());
+  put_header(out, "scmpc_queue_capacity", "gauge",
+             "Songs kept before the oldest ones are dropped");
+  put_sample(out, "scmpc_queue_capacity", NULL, NULL, prefs.queue_length);
+  put_header(out, "scmpc_queue_oldest_age_seconds", "gauge",
+             "Time the oldest queued song has been waiting");
+  put_sample(out, "scmpc_queue_oldest_age_seconds", NULL, NULL,
+             (oldest ? MAX(elapsed(oldest->queued), 0) : 0));
+}
+
+static void collect_endpoints(GString *out) {
+  static const gchar *results[] = {"accepted", "ignored", "failed"};
+  static const gchar *methods[] = {"auth.getMobileSession",
+                                   "track.updateNowPlaying", "track.scrobble"};
+  gchar **labels = g_new0(gchar *, as_conn.count + 1);
+  as_stats *stats = g_new0(as_stats, MAX(as_conn.count, 1));
+
+  for (guint i = 0; i < as_conn.count; i++) {
+    labels[i] = make_label("endpoint", as_conn.endpoints[i].server->name);
+    as_get_stats(i, &stats[i]);
+  }
+
+  put_header(out, "scmpc_endpoint_connected", "gauge",
+             "Whether the endpoint has a session");
+  for (guint i = 0; i < as_conn.count; i++)
+    put_sample(out, "scmpc_endpoint_connected", labels[i], NULL,
+               as_conn.endpoints[i].status == CONNECTED);
+  put_header(out, "scmpc_endpoint_in_flight", "gauge",
+             "Submissions waiting for a response");
+  for (guint i = 0; i < as_conn.count; i++)
+    put_sample(out, "scmpc_endpoint_in_flight", labels[i], NULL,
+               as_conn.endpoints[i].in_flight);
+
+  put_header(out, "scmpc_scrobbles_total", "counter",
+             "Songs submitted, by result, failed ones are sent again");
+  for (guint i = 0; i < as_conn.count; i++) {
+    guint counts[] = {stats[i].accepted, stats[i].ignored, stats[i].failed};
+
+    for (guint j = 0; j < G_N_ELEMENTS(results); j++) {
+      gchar *result = make_label("result", results[j]);
+      put_sample(out, "scmpc_scrobbles_total", labels[i], result, counts[j]);
+      g_free(result);
+    }
+  }
+
+  put_header(out, "scmpc_scrobble_wait_seconds", "summary",
+             "Time songs spent in the queue before the endpoint took them");
+  for (guint i = 0; i < as_conn.count; i++) {
+    put_sample(out, "scmpc_scrobble_wait_seconds_sum", labels[i], NULL,
+               stats[i].queue_time_total);
+    put_sample(out, "scmpc_scrobble_wait_seconds_count", labels[i], NULL,
+               stats[i].submitted);
+  }
+  put_header(out, "scmpc_scrobble_wait_max_seconds", "gauge",
+             "Longest time a song spent in the queue");
+  for (guint i = 0; i < as_conn.count; i++)
+    put_sample(out, "scmpc_scrobble_wait_max_seconds", labels[i], NULL,
+               stats[i].queue_time_max);
+
+  put_header(out, "scmpc_request_duration_seconds", "histogram",
+             "Web service requests by method, including failed ones");
+  for (guint i = 0; i < as_conn.count; i++) {
+    const metrics_histogram *times[] = {&stats[i].auth_time,
+                                        &stats[i].now_playing_time,
+                                        &stats[i].submit_time};
+
+    for (guint j = 0; j < G_N_ELEMENTS(methods); j++) {
+      gchar *method = make_label("method", methods[j]);
+      gchar *both = g_strconcat(labels[i], ",", method, NULL);
+      put_histogram(out, "scmpc_request_duration_seconds", both, times[j]);
+      g_free(both);
+      g_free(method);
+    }
+  }
+
+  put_header(out, "scmpc_backoff_failures", "gauge",
+             "Failures in a row, 0 once a request succeeds");
+  for (guint i = 0; i < as_conn.count; i++) {
+    put_sample(out, "scmpc_backoff_failures", labels[i], "kind=\"auth\"",
+               as_conn.endpoints[i].auth_backoff.failures);
+    put_sample(out, "scmpc_backoff_failures", labels[i], "kind=\"submit\"",
+               as_conn.endpoints[i].submit_backoff.failures);
+  }
+  put_header(out, "scmpc_backoff_delay_seconds", "gauge",
+             "Delay of the scheduled retry, 0 if none is scheduled");
+  for (guint i = 0; i < as_conn.count; i++) {
+    put_sample(out, "scmpc_backoff_delay_seconds", labels[i], "kind=\"auth\"",
+               as_conn.endpoints[i].auth_backoff.delay / 1000.0);
+    put_sample(out, "scmpc_backoff_delay_seconds", labels[i],
+               "kind=\"submit\"",
+               as_conn.endpoints[i].submit_backoff.delay / 1000.0);
+  }
+
+  g_strfreev(labels);
+  g_free(stats);
+}
+
+static void collect_mpd(GString *out) {
+  gchar **labels = g_new0(gchar *, mpd.count + 1);
+
+  for (guint i = 0; i < mpd.count; i++)
+    labels[i] = make_label("server", mpd.instances[i].server->name);
+
+  put_header(out, "scmpc_mpd_connected", "gauge",
+             "Whether the MPD server is connected");
+  for (guint i = 0; i < mpd.count; i++)
+    put_sample(out, "scmpc_mpd_connected", labels[i], NULL,
+               mpd.instances[i].conn != NULL);
+  put_header(out, "scmpc_mpd_reconnect_pending", "gauge",
+             "Whether a reconnect to the MPD server is scheduled");
+  for (guint i = 0; i < mpd.count; i++)
+    put_sample(out, "scmpc_mpd_reconnect_pending", labels[i], NULL,
+               backoff_pending(&mpd.instances[i].reconnect));
+  put_header(out, "scmpc_mpd_connects_total", "counter",
+             "Successful connections to the MPD server");
+  for (guint i = 0; i < mpd.count; i++)
+    put_sample(out, "scmpc_mpd_connects_total", labels[i], NULL,
+               mpd.instances[i].connects);
+  put_header(out, "scmpc_mpd_connect_failures_total", "counter",
+             "Failed connection attempts to the MPD server");
+  for (guint i = 0; i < mpd.count; i++)
+    put_sample(out, "scmpc_mpd_connect_failures_total", labels[i], NULL,
+               mpd.instances[i].connect_failures);
+  put_header(out, "scmpc_mpd_round_trip_seconds", "histogram",
+             "Commands sent to the MPD server until their response");
+  for (guint i = 0; i < mpd.count; i++)
+    put_histogram(out, "scmpc_mpd_round_trip_seconds", labels[i],
+                  &mpd.instances[i].round_trip);
+
+  g_strfreev(labels);
+}
+
+static void collect_storage(GString *out) {
+  cache_stats cache;
+  journal_stats journal;
+  strpool_stats pool;
+
+  cache_get_stats(&cache);
+  journal_get_stats(&journal);
+  strpool_get_stats(&pool);
+
+  put_header(out, "scmpc_cache_save_seconds", "histogram",
+             "Snapshots of the queue, from the first song until in place");
+  put_histogram(out, "scmpc_cache_save_seconds", NULL, &cache.save_time);
+  put_header(out, "scmpc_cache_save_bytes", "gauge",
+             "Size of the last snapshot");
+  put_sample(out, "scmpc_cache_save_bytes", NULL, NULL, cache.bytes);
+  put_header(out, "scmpc_journal_records", "gauge",
+             "Records in the journal since the last snapshot");
+  put_sample(out, "scmpc_journal_records", NULL, NULL, journal.records);
+  put_header(out, "scmpc_journal_written_bytes_total", "counter",
+             "Bytes appended to the journal");
+  put_sample(out, "scmpc_journal_written_bytes_total", NULL, NULL,
+             journal.written);
+  put_header(out, "scmpc_journal_sync_seconds", "histogram",
+             "Flushes of the journal to disk");
+  put_histogram(out, "scmpc_journal_sync_seconds", NULL, &journal.sync_time);
+
+  put_header(out, "scmpc_log_dropped_total", "counter",
+             "Log messages dropped because the log buffer was full");
+  put_sample(out, "scmpc_log_dropped_total", NULL, NULL, log_get_dropped());
+
+  put_header(out, "scmpc_strpool_strings", "gauge",
+             "Distinct artists and albums in memory");
+  put_sample(out, "scmpc_strpool_strings", NULL, NULL, pool.strings);
+  put_header(out, "scmpc_strpool_bytes", "gauge",
+             "Memory used by the string pool");
+  put_sample(out, "scmpc_strpool_bytes", NULL, NULL, pool.bytes);
+  put_header(out, "scmpc_strpool_saved_bytes", "gauge",
+             "Memory saved by sharing strings");
+  put_sample(out, "scmpc_strpool_saved_bytes", NULL, NULL, pool.saved);
+}
+
+static void collect_http(GString *out) {
+  http_stats stats;
+
+  http_get_stats(&stats);
+
+  put_header(out, "scmpc_http_requests_total", "counter",
+             "Finished HTTP requests");
+  put_sample(out, "scmpc_http_requests_total", NULL, NULL, stats.requests);
+  put_header(out, "scmpc_http_connections_total", "counter",
+             "Requests by whether they opened a new connection");
+  put_sample(out, "scmpc_http_connections_total", NULL, "type=\"new\"",
+             stats.new_connections);
+  put_sample(out, "scmpc_http_connections_total", NULL, "type=\"reused\"",
+             stats.reused_connections);
+  put_header(out, "scmpc_http_connect_seconds_total", "counter",
+             "Time spent opening new connections");
+  put_sample(out, "scmpc_http_connect_seconds_total", NULL, NULL,
+             stats.connect_time);
+  put_header(out, "scmpc_http_handshake_seconds_total", "counter",
+             "Time spent in TLS handshakes");
+  put_sample(out, "scmpc_http_handshake_seconds_total", NULL, NULL,
+             stats.handshake_time);
+}
+
+static void collect_wakeups(GString *out) {
+  put_header(out, "scmpc_wakeups_total", "counter",
+             "Main loop wakeups by source");
+  for (guint i = 0; i < WAKEUP_SOURCES; i++) {
+    gchar *label = make_label("source", wakeup_names[i]);
+
+    put_sample(out, "scmpc_wakeups_total", label, NULL, get_wakeups(i));
+    g_free(label);
+  }
+}
+
+static void put_header(GString *out, const gchar *name, const gchar *type,
+                       const gchar *help) {
+  g_string_append_printf(out, "# HELP %s %s.\n# TYPE %s %s\n", name, help,
+                         name, type);
+}
+
+/**
+ * Append a sample, labels and extra are comma-separated label pairs and
+ * may be NULL
+ */
+static void put_sample(GString *out, const gchar *name, const gchar *labels,
+                       const gchar *extra, gdouble value) {
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_string_append(out, name);
+  if (labels || extra) {
+    g_string_append_c(out, '{');
+    if (labels)
+      g_string_append(out, labels);
+    if (labels && extra)
+      g_string_append_c(out, ',');
+    if (extra)
+      g_string_append(out, extra);
+    g_string_append_c(out, '}');
+  }
+  g_string_append_c(out, ' ');
+  // independent of the locale
+  g_string_append(out, g_ascii_formatd(buf, sizeof(buf), "%.9g", value));
+  g_string_append_c(out, '\n');
+}
+
+/**
+ * Append the cumulative buckets, sum and count of a histogram
+ */
+static void put_histogram(GString *out, const gchar *name,
+                          const gchar *labels, const metrics_histogram *h) {
+  static const gdouble bounds[METRICS_BUCKETS] = METRICS_BOUNDS;
+  gchar *bucket = g_strconcat(name, "_bucket", NULL);
+  gchar *sum = g_strconcat(name, "_sum", NULL);
+  gchar *count = g_strconcat(name, "_count", NULL);
+  gchar le[G_ASCII_DTOSTR_BUF_SIZE + 8], buf[G_ASCII_DTOSTR_BUF_SIZE];
+  guint64 total = 0;
+
+  for (guint i = 0; i < METRICS_BUCKETS; i++) {
+    total += h->buckets[i];
+    g_snprintf(le, sizeof(le), "le=\"%s\"",
+               g_ascii_formatd(buf, sizeof(buf), "%g", bounds[i]));
+    put_sample(out, bucket, labels, le, total);
+  }
+  put_sample(out, bucket, labels, "le=\"+Inf\"", h->count);
+  put_sample(out, sum, labels, NULL, h->sum);
+  put_sample(out, count, labels, NULL, h->count);
+
+  g_free(bucket);
+  g_free(sum);
+  g_free(count);
+}
+
+/**
+ * Return name="value" with value escaped for the text format
+ */
+static gchar *make_label(const gchar *name, const gchar *value) {
+  GString *label = g_string_new(name);
+
+  g_string_append(label, "=\"");
+  for (; *value; value++) {
+    if (*value == '\\' || *value == '"')
+      g_string_append_c(label, '\\');
+    if (*value == '\n')
+      g_string_append(label, "\\n");
+    else
+      g_string_append_c(label, *value);
+  }
+  g_string_append_c(label, '"');
+  return g_string_free(label, FALSE);
+}
@@ -0,0 +1,75 @@
+/**
+ * metrics.h: Runtime metrics on a local stats socket.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_METRICS_H
+#define HAVE_METRICS_H
+
+#include <glib.h>
+
+/**
+ * Upper bounds of the histogram buckets in seconds, from a local MPD round
+ * trip up to a request running into cURL's timeout
+ */
+#define METRICS_BOUNDS                                                        \
+  { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 }
+#define METRICS_BUCKETS 13
+
+/**
+ * A latency histogram. Observations are kept per bucket and only added up
+ * when the metrics are read.
+ */
+typedef struct {
+  guint64 buckets[METRICS_BUCKETS + 1];
+  guint64 count;
+  gdouble sum;
+} metrics_histogram;
+
+/**
+ * Record a duration in microseconds, as returned by g_get_monotonic_time()
+ */
+static inline void metrics_observe(metrics_histogram *h, gint64 usec) {
+  static const gdouble bounds[METRICS_BUCKETS] = METRICS_BOUNDS;
+  gdouble secs = MAX(usec, 0) / (gdouble)G_USEC_PER_SEC;
+  guint i = 0;
+
+  while (i < METRICS_BUCKETS && secs > bounds[i])
+    i++;
+  h->buckets[i]++;
+  h->count++;
+  h->sum += secs;
+}
+
+/**
+ * Open the stats socket if one is configured. Failing to open it is only
+ * logged.
+ */
+void metrics_init(void);
+
+/**
+ * Close and remove the stats socket
+ */
+void metrics_cleanup(void);
+
+#endif /* HAVE_METRICS_H */
@@ -34,15 +34,23 @@
 typedef enum { DISCONNECTED, CONNECTED, BADAUTH } connection_status;
 
 /**
- * Open the log file for writing
+ * Main loop sources that wake scmpc up. While nothing is playing and
+ * nothing is queued, none of them should fire.
  */
-void open_log(const gchar *filename);
-
-/**
- * GLib logging handler, should not be called directly
- */
-void scmpc_log(const gchar *log_domain, GLogLevelFlags log_level,
-               const gchar *message, gpointer user_data);
+typedef enum {
+  WAKEUP_SIGNAL,
+  WAKEUP_STATS,
+  WAKEUP_MPD_IDLE,
+  WAKEUP_MPD_CHECK,
+  WAKEUP_MPD_RECONNECT,
+  WAKEUP_AS_RETRY,
+  WAKEUP_AS_FLUSH,
+  WAKEUP_WORKER,
+  WAKEUP_CACHE_SAVE,
+  WAKEUP_JOURNAL_SYNC,
+  WAKEUP_JOURNAL_COMPACT,
+  WAKEUP_SOURCES
+} wakeup_source;
 
 /**
  * Return the current UNIX timestamp
@@ -55,8 +63,13 @@ gint64 get_time(void);
 gint64 elapsed(gint64 since);
 
 /**
- * Write to the cURL data buffer, do not use directly
+ * Count a wakeup of the main loop by source, from the main thread only
+ */
+void count_wakeup(wakeup_source source);
+
+/**
+ * Return the number of wakeups by source since startup
  */
-gsize buffer_write(void *input, gsize size, gsize nmemb, void *buf);
+guint64 get_wakeups(wakeup_source source);
 
 #endif /* HAVE_MISC_H */
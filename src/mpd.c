@@ -23,139 +23,247 @@
  * ==================================================================
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <mpd/client.h>
 
 #include "audioscrobbler.h"
+#include "misc.h"
 #include "mpd.h"
 #include "preferences.h"
 #include "queue.h"
 #include "scmpc.h"
+#include "strpool.h"
+#include "trace.h"
+
+/**
+ * A song that jumps back to less than this many milliseconds from its
+ * start is played again, as with repeat in single mode
+ */
+#define SONG_RESTART 2000
 
-static void mpd_update(void);
-static void mpd_schedule_check(void);
+static void mpd_set_status(mpd_instance *m, struct mpd_status *status);
+static void mpd_set_song(mpd_instance *m, struct mpd_song *song);
+static void mpd_update(mpd_instance *m);
+static gboolean mpd_song_changed(const mpd_instance *m,
+                                 enum mpd_state prev_state,
+                                 guint prev_elapsed);
 static gboolean mpd_parse(GIOChannel *source, GIOCondition condition,
                           gpointer data);
 
-gboolean mpd_connect(void) {
-  mpd.conn = mpd_connection_new(prefs.mpd_hostname, prefs.mpd_port,
-                                prefs.mpd_timeout * 1000);
-  if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SUCCESS) {
-    g_warning("Failed to connect to MPD: %s",
-              mpd_connection_get_error_message(mpd.conn));
+void mpd_init(void) {
+  mpd.count = prefs.mpd_count;
+  mpd.instances = g_new0(mpd_instance, mpd.count);
+
+  for (guint i = 0; i < mpd.count; i++) {
+    mpd_instance *m = &mpd.instances[i];
+
+    m->server = &prefs.mpd_servers[i];
+    m->reconnect_name = g_strdup_printf("MPD %s", m->server->name);
+    backoff_init(&m->reconnect, m->reconnect_name, mpd_reconnect, m);
+    if (!mpd_connect(m)) {
+      mpd_disconnect(m);
+      mpd_schedule_reconnect(m);
+    }
+  }
+}
+
+void mpd_cleanup(void) {
+  for (guint i = 0; i < mpd.count; i++) {
+    mpd_instance *m = &mpd.instances[i];
+
+    mpd_set_song(m, NULL);
+    mpd_set_status(m, NULL);
+    mpd_disconnect(m);
+    backoff_reset(&m->reconnect);
+    g_free(m->reconnect_name);
+  }
+
+  g_free(mpd.instances);
+  mpd.instances = NULL;
+  mpd.count = 0;
+}
+
+gboolean mpd_connect(mpd_instance *m) {
+  gint prev_id = (m->song ? (gint)mpd_song_get_id(m->song) : -1);
+  gint64 start;
+
+  m->conn = mpd_connection_new(m->server->host, m->server->port,
+                               m->server->timeout * 1000);
+  if (mpd_connection_get_error(m->conn) != MPD_ERROR_SUCCESS) {
+    g_warning("Failed to connect to MPD %s: %s", m->server->name,
+              mpd_connection_get_error_message(m->conn));
+    m->connect_failures++;
     return FALSE;
-  } else if (mpd_connection_cmp_server_version(mpd.conn, 0, 14, 0) < 0) {
-    g_critical("MPD too old, please upgrade to 0.14 or newer");
+  } else if (mpd_connection_cmp_server_version(m->conn, 0, 14, 0) < 0) {
+    g_critical("MPD %s too old, please upgrade to 0.14 or newer",
+               m->server->name);
     scmpc_shutdown();
     return FALSE;
   } else {
-    mpd_command_list_begin(mpd.conn, TRUE);
-    mpd_send_status(mpd.conn);
-    mpd_send_current_song(mpd.conn);
-    mpd_command_list_end(mpd.conn);
-
-    mpd.status = mpd_recv_status(mpd.conn);
-    mpd_response_next(mpd.conn);
-    mpd.song = mpd_recv_song(mpd.conn);
-    mpd_response_finish(mpd.conn);
-
-    if (mpd_connection_get_error(mpd.conn) != MPD_ERROR_SUCCESS) {
-      g_warning("Failed to connect to MPD: %s",
-                mpd_connection_get_error_message(mpd.conn));
-      mpd_disconnect();
-      mpd_schedule_reconnect();
+    start = g_get_monotonic_time();
+    mpd_command_list_begin(m->conn, TRUE);
+    mpd_send_status(m->conn);
+    mpd_send_current_song(m->conn);
+    mpd_command_list_end(m->conn);
+
+    mpd_set_status(m, mpd_recv_status(m->conn));
+    mpd_response_next(m->conn);
+    mpd_set_song(m, mpd_recv_song(m->conn));
+    mpd_response_finish(m->conn);
+    metrics_observe(&m->round_trip, g_get_monotonic_time() - start);
+
+    if (mpd_connection_get_error(m->conn) != MPD_ERROR_SUCCESS) {
+      g_warning("Failed to connect to MPD %s: %s", m->server->name,
+                mpd_connection_get_error_message(m->conn));
+      m->connect_failures++;
       return FALSE;
     }
 
-    g_message("Connected to MPD");
+    g_message("Connected to MPD %s", m->server->name);
+    m->connects++;
 
-    mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+    mpd_send_idle_mask(m->conn, MPD_IDLE_PLAYER);
 
     GIOChannel *channel =
-        g_io_channel_unix_new(mpd_connection_get_fd(mpd.conn));
-    mpd.idle_source = g_io_add_watch(channel, G_IO_IN, mpd_parse, NULL);
+        g_io_channel_unix_new(mpd_connection_get_fd(m->conn));
+    m->idle_source = g_io_add_watch(channel, G_IO_IN, mpd_parse, m);
     g_io_channel_unref(channel);
-    mpd.check_source = 0;
-
-    if (mpd_status_get_state(mpd.status) == MPD_STATE_PLAY) {
-      as_now_playing();
-      g_timer_start(mpd.song_pos);
-      mpd_schedule_check();
-    } else {
-      mpd.check_source = 0;
-      g_timer_stop(mpd.song_pos);
-      mpd.song_state = SONG_NEW;
+
+    // a song that was already submitted before we lost the connection
+    // isn't submitted again
+    if (!m->song || (gint)mpd_song_get_id(m->song) != prev_id) {
+      m->song_date = get_time() - m->elapsed / 1000;
+      m->song_state = SONG_NEW;
     }
+    if (mpd_status_get_state(m->status) == MPD_STATE_PLAY &&
+        m->song_state == SONG_NEW)
+      as_now_playing(m);
+    mpd_schedule_check(m);
 
     return TRUE;
   }
 }
 
 /**
- * Parse status changes, check for state changes (play/stop/pause) and
- * retrieve the current song on play->play or stop->play.
- * Clean up on play->pause and *->stop
+ * Replace the last status and note when its position was read
  */
-static void mpd_update(void) {
-  enum mpd_state prev_state = MPD_STATE_UNKNOWN;
+static void mpd_set_status(mpd_instance *m, struct mpd_status *status) {
+  if (m->status)
+    mpd_status_free(m->status);
 
-  if (mpd.status) {
-    prev_state = mpd_status_get_state(mpd.status);
-    mpd_status_free(mpd.status);
-  }
-  mpd.status = mpd_run_status(mpd.conn);
-  mpd_response_finish(mpd.conn);
-
-  if (mpd_status_get_state(mpd.status) == MPD_STATE_PLAY) {
-    if (prev_state == MPD_STATE_PLAY || prev_state == MPD_STATE_STOP) {
-      // initialize new song
-      if (mpd.song)
-        mpd_song_free(mpd.song);
-      mpd.song = mpd_run_current_song(mpd.conn);
-      mpd_response_finish(mpd.conn);
-      g_timer_start(mpd.song_pos);
-      mpd.song_date = get_time();
-      mpd.song_state = SONG_NEW;
-
-      // submit previous song(s)
-      as_check_submit();
-
-      // send now playing at the end so it won't be
-      // overwritten by the queue
-      as_now_playing();
-
-      // schedule queueing
-      mpd_schedule_check();
-    } else if (prev_state == MPD_STATE_PAUSE) {
-      if (mpd.song_state == SONG_NEW)
-        as_now_playing();
-      g_timer_continue(mpd.song_pos);
-    }
-  } else if (mpd_status_get_state(mpd.status) == MPD_STATE_PAUSE &&
-             prev_state == MPD_STATE_PLAY) {
-    g_timer_stop(mpd.song_pos);
-  } else if (mpd_status_get_state(mpd.status) == MPD_STATE_STOP) {
-    as_check_submit();
-    if (mpd.check_source > 0)
-      g_source_remove(mpd.check_source);
-    mpd.check_source = 0;
+  m->status = status;
+  m->elapsed = (status ? mpd_status_get_elapsed_ms(status) : 0);
+  m->elapsed_time = g_get_monotonic_time();
+}
+
+/**
+ * Replace the current song and intern its artist and album, so that
+ * queueing it later only takes references
+ */
+static void mpd_set_song(mpd_instance *m, struct mpd_song *song) {
+  if (m->song)
+    mpd_song_free(m->song);
+  strpool_unref(m->artist);
+  strpool_unref(m->album);
+
+  m->song = song;
+  m->artist = m->album = m->title = NULL;
+  if (!song)
+    return;
+
+  m->artist = strpool_intern(mpd_song_get_tag(song, MPD_TAG_ARTIST, 0));
+  m->album = strpool_intern(mpd_song_get_tag(song, MPD_TAG_ALBUM, 0));
+  m->title = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
+}
+
+/**
+ * Parse status changes. The current song is retrieved when MPD starts
+ * playing after a stop or moves on to another song, and the submission
+ * check is rescheduled on every event, as pausing, resuming and seeking
+ * all move its deadline.
+ */
+static void mpd_update(mpd_instance *m) {
+  enum mpd_state prev_state = MPD_STATE_UNKNOWN, state;
+  guint prev_elapsed = mpd_song_elapsed(m);
+  struct mpd_song *song;
+  gint64 start;
+
+  if (m->status)
+    prev_state = mpd_status_get_state(m->status);
+  start = g_get_monotonic_time();
+  mpd_set_status(m, mpd_run_status(m->conn));
+  mpd_response_finish(m->conn);
+  metrics_observe(&m->round_trip, g_get_monotonic_time() - start);
+  state = mpd_status_get_state(m->status);
+
+  if ((state == MPD_STATE_PLAY || state == MPD_STATE_PAUSE) &&
+      (prev_state == MPD_STATE_STOP ||
+       mpd_song_changed(m, prev_state, prev_elapsed))) {
+    // initialize new song
+    start = g_get_monotonic_time();
+    song = mpd_run_current_song(m->conn);
+    mpd_response_finish(m->conn);
+    metrics_observe(&m->round_trip, g_get_monotonic_time() - start);
+    mpd_set_song(m, song);
+    if (song)
+      TRACE3(song_change, m->server->name, mpd_song_get_id(song),
+             mpd_song_get_duration(song));
+    m->song_date = get_time() - m->elapsed / 1000;
+    m->song_state = SONG_NEW;
   }
+
+  // also when resuming a song that was skipped to while paused
+  if (state == MPD_STATE_PLAY && m->song_state == SONG_NEW)
+    as_now_playing(m);
+
+  mpd_schedule_check(m);
 }
 
 /**
- * Schedule a check of the current song for submission
+ * Whether MPD is playing another song than the current one, or started it
+ * over
  */
-static void mpd_schedule_check(void) {
-  gushort timeout;
+static gboolean mpd_song_changed(const mpd_instance *m,
+                                 enum mpd_state prev_state,
+                                 guint prev_elapsed) {
+  if (!m->song ||
+      mpd_status_get_song_id(m->status) != (gint)mpd_song_get_id(m->song))
+    return TRUE;
 
-  if (mpd.check_source > 0)
-    g_source_remove(mpd.check_source);
+  return (prev_state == MPD_STATE_PLAY &&
+          mpd_status_get_state(m->status) == MPD_STATE_PLAY &&
+          m->elapsed < SONG_RESTART && m->elapsed < prev_elapsed);
+}
+
+guint mpd_song_elapsed(const mpd_instance *m) {
+  if (!m->status || mpd_status_get_state(m->status) != MPD_STATE_PLAY)
+    return m->elapsed;
+
+  return m->elapsed + (g_get_monotonic_time() - m->elapsed_time) / 1000;
+}
+
+guint mpd_song_threshold(const mpd_instance *m) {
+  return MIN(mpd_song_get_duration(m->song) * 500, 240000);
+}
 
-  if (mpd_song_get_duration(mpd.song) >= 480)
-    timeout = 240;
-  else
-    timeout = mpd_song_get_duration(mpd.song) * 0.5;
+void mpd_schedule_check(mpd_instance *m) {
+  guint elapsed, threshold;
 
-  mpd.check_source = g_timeout_add_seconds(timeout, scmpc_check, NULL);
+  if (m->check_source > 0)
+    g_source_remove(m->check_source);
+  m->check_source = 0;
+
+  if (!m->song || m->song_state == SONG_SUBMITTED || !m->status ||
+      mpd_status_get_state(m->status) != MPD_STATE_PLAY)
+    return;
+
+  elapsed = mpd_song_elapsed(m);
+  threshold = mpd_song_threshold(m);
+  m->check_source = g_timeout_add(
+      (threshold > elapsed ? threshold - elapsed : 0), scmpc_check, m);
 }
 
 /**
@@ -163,41 +271,48 @@ static void mpd_schedule_check(void) {
  */
 static gboolean mpd_parse(G_GNUC_UNUSED GIOChannel *source,
                           G_GNUC_UNUSED GIOCondition condition,
-                          G_GNUC_UNUSED gpointer data) {
-  enum mpd_idle events = mpd_recv_idle(mpd.conn, FALSE);
-
-  if (!mpd_response_finish(mpd.conn)) {
-    g_warning("Failed to read MPD response: %s",
-              mpd_connection_get_error_message(mpd.conn));
-    mpd_disconnect();
-    mpd_schedule_reconnect();
+                          gpointer data) {
+  mpd_instance *m = data;
+  enum mpd_idle events = mpd_recv_idle(m->conn, FALSE);
+
+  count_wakeup(WAKEUP_MPD_IDLE);
+  if (!mpd_response_finish(m->conn)) {
+    g_warning("Failed to read response from MPD %s: %s", m->server->name,
+              mpd_connection_get_error_message(m->conn));
+    m->idle_source = 0;
+    mpd_disconnect(m);
+    mpd_schedule_reconnect(m);
     return FALSE;
   }
 
   if (events & MPD_IDLE_PLAYER) {
-    mpd_update();
+    mpd_update(m);
   }
 
-  mpd_send_idle_mask(mpd.conn, MPD_IDLE_PLAYER);
+  mpd_send_idle_mask(m->conn, MPD_IDLE_PLAYER);
   return TRUE;
 }
 
-gboolean mpd_reconnect(G_GNUC_UNUSED gpointer data) {
-  if (!mpd_connect()) {
-    mpd_disconnect();
-    return TRUE;
+gboolean mpd_reconnect(gpointer data) {
+  mpd_instance *m = data;
+
+  count_wakeup(WAKEUP_MPD_RECONNECT);
+  if (!mpd_connect(m)) {
+    mpd_disconnect(m);
+    mpd_schedule_reconnect(m);
+    return FALSE;
   }
 
-  mpd.reconnect_source = 0;
+  backoff_reset(&m->reconnect);
   return FALSE;
 }
 
-void mpd_disconnect(void) {
-  if (mpd.conn)
-    mpd_connection_free(mpd.conn);
-  mpd.conn = NULL;
+void mpd_disconnect(mpd_instance *m) {
+  if (m->conn)
+    mpd_connection_free(m->conn);
+  m->conn = NULL;
 }
 
-void mpd_schedule_reconnect(void) {
-  mpd.reconnect_source = g_timeout_add_seconds(30, mpd_reconnect, NULL);
+void mpd_schedule_reconnect(mpd_instance *m) {
+  backoff_fail(&m->reconnect, BACKOFF_MPD);
 }
@@ -28,39 +28,95 @@
 
 #include <glib.h>
 
+#include "backoff.h"
+#include "metrics.h"
+#include "preferences.h"
+
 /**
- * MPD connection data
+ * Connection and playback state of one MPD server
  */
-struct {
+typedef struct mpd_instance {
+  const mpd_server *server;
   struct mpd_connection *conn;
   struct mpd_status *status;
   struct mpd_song *song;
-  GTimer *song_pos;
+  /* tags of the current song, artist and album are interned */
+  const gchar *artist;
+  const gchar *album;
+  const gchar *title;
+  /* position in the current song in ms as of elapsed_time, from MPD */
+  guint elapsed;
+  gint64 elapsed_time;
   gint64 song_date;
   enum { SONG_NEW, SONG_ANNOUNCED, SONG_SUBMITTED } song_state;
   guint idle_source;
   guint check_source;
-  guint reconnect_source;
+  backoff reconnect;
+  gchar *reconnect_name;
+  /* connection attempts since startup */
+  guint connects;
+  guint connect_failures;
+  /* synchronous commands, from sending to the end of the response */
+  metrics_histogram round_trip;
+} mpd_instance;
+
+/**
+ * All MPD servers being monitored, one for each mpd section
+ */
+struct {
+  mpd_instance *instances;
+  guint count;
 } mpd;
 
+/**
+ * Set up an instance for every configured server and connect to them
+ */
+void mpd_init(void);
+
+/**
+ * Disconnect from all servers and release resources
+ */
+void mpd_cleanup(void);
+
 /**
  * Connect to MPD
  */
-gboolean mpd_connect(void);
+gboolean mpd_connect(mpd_instance *instance);
 
 /**
- * Wrapper around #mpd_disconnect and #mpd_connect
+ * Wrapper around #mpd_disconnect and #mpd_connect that schedules the next
+ * attempt if it fails, data is the instance
  */
 gboolean mpd_reconnect(gpointer data);
 
 /**
  * Disconnect from MPD
  */
-void mpd_disconnect(void);
+void mpd_disconnect(mpd_instance *instance);
+
+/**
+ * Schedule a reconnect to the MPD server. Attempts back off while it stays
+ * unreachable, so a player that is switched off costs few wakeups.
+ */
+void mpd_schedule_reconnect(mpd_instance *instance);
+
+/**
+ * Return how far the current song has been played in milliseconds, going
+ * by the position in MPD's last status
+ */
+guint mpd_song_elapsed(const mpd_instance *instance);
+
+/**
+ * Return after how many milliseconds of playing a song is submitted: half
+ * its length, but no more than four minutes
+ */
+guint mpd_song_threshold(const mpd_instance *instance);
 
 /**
- * Schedule a reconnect to the MPD server
+ * Schedule the submission check of the current song for when it has been
+ * played long enough, or cancel it while the song isn't playing. Only MPD's
+ * player events change the deadline.
  */
-void mpd_schedule_reconnect(void);
+void mpd_schedule_check(mpd_instance *instance);
 
 #endif /* HAVE_MPD_H */
@@ -37,10 +37,14 @@
 
 static gint cf_log_level(cfg_t *cfg, cfg_opt_t *opt, const gchar *value,
                          void *result);
+static gint cf_sync_policy(cfg_t *cfg, cfg_opt_t *opt, const gchar *value,
+                           void *result);
 static gint cf_validate_num(cfg_t *cfg, cfg_opt_t *opt);
 static void free_config_files(gchar **config_files);
 static gboolean parse_files(cfg_t *cfg);
 static gchar *expand_tilde(const gchar *path);
+static void clear_mpd_servers(void);
+static void clear_as_servers(void);
 static gboolean parse_config_file(void);
 static gboolean parse_command_line(gint argc, gchar **argv);
 
@@ -68,6 +72,26 @@ static gint cf_log_level(cfg_t *cfg, cfg_opt_t *opt, const gchar *value,
   return 0;
 }
 
+/**
+ * Parse cache_sync values from the config file and set result to a
+ * sync_policy value
+ */
+static gint cf_sync_policy(cfg_t *cfg, cfg_opt_t *opt, const gchar *value,
+                           void *result) {
+  if (!strncmp(value, "always", 6))
+    *(sync_policy *)result = SYNC_ALWAYS;
+  else if (!strncmp(value, "batch", 5))
+    *(sync_policy *)result = SYNC_BATCH;
+  else if (!strncmp(value, "never", 5))
+    *(sync_policy *)result = SYNC_NEVER;
+  else {
+    cfg_error(cfg, "Invalid value for option '%s': '%s'", cfg_opt_name(opt),
+              value);
+    return -1;
+  }
+  return 0;
+}
+
 /**
  * Check if the given opt value is non-negative
  */
@@ -146,21 +170,64 @@ static gchar *expand_tilde(const gchar *path) {
   return g_strdup(path);
 }
 
+/**
+ * Release the settings of all MPD servers
+ */
+static void clear_mpd_servers(void) {
+  for (guint i = 0; i < prefs.mpd_count; i++) {
+    g_free(prefs.mpd_servers[i].name);
+    g_free(prefs.mpd_servers[i].host);
+    g_free(prefs.mpd_servers[i].password);
+  }
+  g_free(prefs.mpd_servers);
+  prefs.mpd_servers = NULL;
+  prefs.mpd_count = 0;
+}
+
+/**
+ * Release the settings of all scrobbling endpoints
+ */
+static void clear_as_servers(void) {
+  for (guint i = 0; i < prefs.as_count; i++) {
+    as_server *server = &prefs.as_servers[i];
+
+    g_free(server->name);
+    g_free(server->url);
+    g_free(server->api_key);
+    g_free(server->secret);
+    g_free(server->username);
+    g_free(server->password);
+    g_free(server->password_hash);
+  }
+  g_free(prefs.as_servers);
+  prefs.as_servers = NULL;
+  prefs.as_count = 0;
+}
+
 /**
  * Parse config file options
  */
 static gboolean parse_config_file(void) {
   cfg_t *cfg, *sec_as, *sec_mpd;
 
-  cfg_opt_t mpd_opts[] = {CFG_STR("host", "localhost", CFGF_NONE),
+  cfg_opt_t mpd_opts[] = {CFG_STR("name", "", CFGF_NONE),
+                          CFG_STR("host", "localhost", CFGF_NONE),
                           CFG_INT("port", 6600, CFGF_NONE),
                           CFG_INT("timeout", 5, CFGF_NONE),
                           CFG_INT("interval", 10, CFGF_NONE),
                           CFG_STR("password", "", CFGF_NONE),
                           CFG_END()};
-  cfg_opt_t as_opts[] = {CFG_STR("username", "", CFGF_NONE),
+  cfg_opt_t as_opts[] = {CFG_STR("name", "", CFGF_NONE),
+                         CFG_STR("url", "", CFGF_NONE),
+                         CFG_STR("api_key", "", CFGF_NONE),
+                         CFG_STR("secret", "", CFGF_NONE),
+                         CFG_STR("username", "", CFGF_NONE),
                          CFG_STR("password", "", CFGF_NONE),
-                         CFG_STR("password_hash", "", CFGF_NONE), CFG_END()};
+                         CFG_STR("password_hash", "", CFGF_NONE),
+                         CFG_INT("drain_requests", 2, CFGF_NONE),
+                         CFG_INT("submit_batch", 10, CFGF_NONE),
+                         CFG_INT("submit_latency", 300, CFGF_NONE),
+                         CFG_BOOL("https", cfg_false, CFGF_NONE), CFG_END()};
   cfg_opt_t opts[] = {
       CFG_INT_CB("log_level", G_LOG_LEVEL_ERROR, CFGF_NONE, &cf_log_level),
       CFG_STR("log_file", "/var/log/scmpc.log", CFGF_NONE),
@@ -168,15 +235,28 @@ static gboolean parse_config_file(void) {
       CFG_STR("cache_file", "/var/lib/scmpc/scmpc.cache", CFGF_NONE),
       CFG_INT("queue_length", 500, CFGF_NONE),
       CFG_INT("cache_interval", 10, CFGF_NONE),
-      CFG_SEC("mpd", mpd_opts, CFGF_NONE),
-      CFG_SEC("audioscrobbler", as_opts, CFGF_NONE),
+      CFG_INT_CB("cache_sync", SYNC_BATCH, CFGF_NONE, &cf_sync_policy),
+      CFG_INT("cache_sync_delay", 2, CFGF_NONE),
+      CFG_STR("stats_socket", "", CFGF_NONE),
+      CFG_INT("http_keepalive", 60, CFGF_NONE),
+      CFG_INT("http_idle_timeout", 60, CFGF_NONE),
+      CFG_SEC("mpd", mpd_opts, CFGF_MULTI),
+      CFG_SEC("audioscrobbler", as_opts, CFGF_MULTI),
       CFG_END()};
 
   cfg = cfg_init(opts, CFGF_NONE);
   cfg_set_validate_func(cfg, "queue_length", &cf_validate_num);
   cfg_set_validate_func(cfg, "cache_interval", &cf_validate_num);
+  cfg_set_validate_func(cfg, "cache_sync_delay", &cf_validate_num);
+  cfg_set_validate_func(cfg, "http_keepalive", &cf_validate_num);
+  cfg_set_validate_func(cfg, "http_idle_timeout", &cf_validate_num);
   cfg_set_validate_func(cfg, "mpd|port", &cf_validate_num);
   cfg_set_validate_func(cfg, "mpd|timeout", &cf_validate_num);
+  cfg_set_validate_func(cfg, "audioscrobbler|drain_requests",
+                        &cf_validate_num);
+  cfg_set_validate_func(cfg, "audioscrobbler|submit_batch", &cf_validate_num);
+  cfg_set_validate_func(cfg, "audioscrobbler|submit_latency",
+                        &cf_validate_num);
 
   if (parse_files(cfg) == FALSE) {
     cfg_free(cfg);
@@ -186,11 +266,9 @@ static gboolean parse_config_file(void) {
   g_free(prefs.log_file);
   g_free(prefs.pid_file);
   g_free(prefs.cache_file);
-  g_free(prefs.mpd_hostname);
-  g_free(prefs.mpd_password);
-  g_free(prefs.as_username);
-  g_free(prefs.as_password);
-  g_free(prefs.as_password_hash);
+  g_free(prefs.stats_socket);
+  clear_mpd_servers();
+  clear_as_servers();
 
   prefs.log_level = cfg_getint(cfg, "log_level");
   prefs.log_file = expand_tilde(cfg_getstr(cfg, "log_file"));
@@ -198,17 +276,67 @@ static gboolean parse_config_file(void) {
   prefs.cache_file = expand_tilde(cfg_getstr(cfg, "cache_file"));
   prefs.queue_length = cfg_getint(cfg, "queue_length");
   prefs.cache_interval = cfg_getint(cfg, "cache_interval");
+  prefs.cache_sync = cfg_getint(cfg, "cache_sync");
+  prefs.cache_sync_delay = cfg_getint(cfg, "cache_sync_delay");
+  prefs.stats_socket = expand_tilde(cfg_getstr(cfg, "stats_socket"));
+  prefs.http_keepalive = cfg_getint(cfg, "http_keepalive");
+  prefs.http_idle_timeout = cfg_getint(cfg, "http_idle_timeout");
+
+  // without any mpd section, watch the local server
+  prefs.mpd_count = MAX(cfg_size(cfg, "mpd"), 1);
+  prefs.mpd_servers = g_new0(mpd_server, prefs.mpd_count);
+  if (cfg_size(cfg, "mpd") == 0) {
+    prefs.mpd_servers[0].name = g_strdup("");
+    prefs.mpd_servers[0].host = g_strdup("localhost");
+    prefs.mpd_servers[0].port = 6600;
+    prefs.mpd_servers[0].timeout = 5;
+    prefs.mpd_servers[0].password = g_strdup("");
+  }
 
-  sec_mpd = cfg_getsec(cfg, "mpd");
-  prefs.mpd_hostname = g_strdup(cfg_getstr(sec_mpd, "host"));
-  prefs.mpd_port = cfg_getint(sec_mpd, "port");
-  prefs.mpd_timeout = cfg_getint(sec_mpd, "timeout");
-  prefs.mpd_password = g_strdup(cfg_getstr(sec_mpd, "password"));
+  for (guint i = 0; i < cfg_size(cfg, "mpd"); i++) {
+    mpd_server *server = &prefs.mpd_servers[i];
 
-  sec_as = cfg_getsec(cfg, "audioscrobbler");
-  prefs.as_username = g_strdup(cfg_getstr(sec_as, "username"));
-  prefs.as_password = g_strdup(cfg_getstr(sec_as, "password"));
-  prefs.as_password_hash = g_strdup(cfg_getstr(sec_as, "password_hash"));
+    sec_mpd = cfg_getnsec(cfg, "mpd", i);
+    server->name = g_strdup(cfg_getstr(sec_mpd, "name"));
+    server->host = g_strdup(cfg_getstr(sec_mpd, "host"));
+    server->port = cfg_getint(sec_mpd, "port");
+    server->timeout = cfg_getint(sec_mpd, "timeout");
+    server->password = g_strdup(cfg_getstr(sec_mpd, "password"));
+  }
+
+  // without any audioscrobbler section, use one with the defaults
+  if (cfg_size(cfg, "audioscrobbler") == 0)
+    cfg_parse_buf(cfg, "audioscrobbler {}");
+  prefs.as_count = cfg_size(cfg, "audioscrobbler");
+  if (prefs.as_count > QUEUE_MAX_ENDPOINTS) {
+    fprintf(stderr, "Only the first %d audioscrobbler sections are used.\n",
+            QUEUE_MAX_ENDPOINTS);
+    prefs.as_count = QUEUE_MAX_ENDPOINTS;
+  }
+  prefs.as_servers = g_new0(as_server, prefs.as_count);
+
+  for (guint i = 0; i < prefs.as_count; i++) {
+    as_server *server = &prefs.as_servers[i];
+
+    sec_as = cfg_getnsec(cfg, "audioscrobbler", i);
+    server->name = g_strdup(cfg_getstr(sec_as, "name"));
+    server->url = g_strdup(cfg_getstr(sec_as, "url"));
+    server->api_key = g_strdup(cfg_getstr(sec_as, "api_key"));
+    server->secret = g_strdup(cfg_getstr(sec_as, "secret"));
+    server->username = g_strdup(cfg_getstr(sec_as, "username"));
+    server->password = g_strdup(cfg_getstr(sec_as, "password"));
+    server->password_hash = g_strdup(cfg_getstr(sec_as, "password_hash"));
+    server->https = cfg_getbool(sec_as, "https");
+    server->drain_requests = cfg_getint(sec_as, "drain_requests");
+    server->submit_batch = MAX(cfg_getint(sec_as, "submit_batch"), 1);
+    server->submit_latency = cfg_getint(sec_as, "submit_latency");
+
+    if (strlen(server->name) == 0) {
+      g_free(server->name);
+      server->name = g_strdup(strlen(server->url) ? server->url
+                                                  : "Audioscrobbler");
+    }
+  }
 
   prefs.fork = TRUE;
 
@@ -294,36 +422,46 @@ static gboolean parse_command_line(gint argc, gchar **argv) {
 
 gboolean init_preferences(gint argc, gchar **argv) {
   gchar *tmp, *saveptr;
+  mpd_server *server;
 
   if (parse_command_line(argc, argv) == FALSE)
     return FALSE;
 
+  // the environment only overrides the first mpd section
+  server = &prefs.mpd_servers[0];
   tmp = getenv("MPD_HOST");
   if (tmp) {
-    g_free(prefs.mpd_password);
-    g_free(prefs.mpd_hostname);
+    g_free(server->password);
+    g_free(server->host);
     if (g_strrstr(tmp, "@")) {
-      prefs.mpd_password = g_strdup(strtok_r(tmp, "@", &saveptr));
-      prefs.mpd_hostname = g_strdup(strtok_r(NULL, "@", &saveptr));
+      server->password = g_strdup(strtok_r(tmp, "@", &saveptr));
+      server->host = g_strdup(strtok_r(NULL, "@", &saveptr));
     } else {
-      prefs.mpd_password = g_strdup("");
-      prefs.mpd_hostname = g_strdup(tmp);
+      server->password = g_strdup("");
+      server->host = g_strdup(tmp);
     }
   }
   if (getenv("MPD_PORT"))
-    prefs.mpd_port = strtol(getenv("MPD_PORT"), NULL, 10);
+    server->port = strtol(getenv("MPD_PORT"), NULL, 10);
+
+  // servers without a name are logged by their address
+  for (guint i = 0; i < prefs.mpd_count; i++) {
+    server = &prefs.mpd_servers[i];
+    if (strlen(server->name) == 0) {
+      g_free(server->name);
+      server->name = g_strdup_printf("%s:%d", server->host, server->port);
+    }
+  }
 
   return TRUE;
 }
 
 void clear_preferences(void) {
-  g_free(prefs.mpd_hostname);
-  g_free(prefs.mpd_password);
+  clear_mpd_servers();
+  clear_as_servers();
   g_free(prefs.config_file);
   g_free(prefs.log_file);
   g_free(prefs.pid_file);
   g_free(prefs.cache_file);
-  g_free(prefs.as_username);
-  g_free(prefs.as_password);
-  g_free(prefs.as_password_hash);
+  g_free(prefs.stats_socket);
 }
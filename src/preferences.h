@@ -28,25 +28,58 @@
 
 #include <glib.h>
 
+#include "journal.h"
+
+/**
+ * Settings of one mpd section
+ */
+typedef struct {
+  gchar *name;
+  gchar *host;
+  gushort port;
+  gushort timeout;
+  gchar *password;
+} mpd_server;
+
+/**
+ * Settings of one audioscrobbler section. Empty url, api_key and secret
+ * mean Last.fm.
+ */
+typedef struct {
+  gchar *name;
+  gchar *url;
+  gchar *api_key;
+  gchar *secret;
+  gchar *username;
+  gchar *password;
+  gchar *password_hash;
+  gboolean https;
+  guint drain_requests;
+  guint submit_batch;
+  guint submit_latency;
+} as_server;
+
 /**
  * scmpc settings
  */
 struct {
-  gchar *mpd_hostname;
-  gushort mpd_port;
-  gushort mpd_timeout;
-  gchar *mpd_password;
+  mpd_server *mpd_servers;
+  guint mpd_count;
   gboolean fork;
   GLogLevelFlags log_level;
   gchar *config_file;
   gchar *log_file;
   gchar *pid_file;
-  gchar *as_username;
-  gchar *as_password;
-  gchar *as_password_hash;
+  as_server *as_servers;
+  guint as_count;
+  guint http_keepalive;
+  guint http_idle_timeout;
   gchar *cache_file;
   guint queue_length;
   guint cache_interval;
+  sync_policy cache_sync;
+  guint cache_sync_delay;
+  gchar *stats_socket;
 } prefs;
 
 /**
@@ -23,190 +23,518 @@
  * ==================================================================
  */
 
-#include <errno.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <mpd/client.h>
 
+#include "cache.h"
+#include "journal.h"
+#include "log.h"
+#include "misc.h"
 #include "mpd.h"
 #include "preferences.h"
 #include "queue.h"
 #include "scmpc.h"
+#include "strpool.h"
+#include "trace.h"
+
+typedef struct queue_chunk queue_chunk;
+
+static queue_node *queue_alloc_song(gsize title_len);
+static void queue_free_song(queue_node *song);
+static void queue_release_chunk(queue_chunk *chunk);
+static void queue_grow(void);
+static void queue_pop_head(void);
+static void queue_changed(void);
+static gboolean queue_save_timeout(gpointer data);
+static guint32 queue_all_endpoints(void);
+static queue_node *queue_push(guint64 id, const gchar *artist,
+                              const gchar *title, gsize title_len,
+                              const gchar *album, guint length, gint track,
+                              gint64 date, guint32 acked);
+
+/**
+ * Internal song queue, a ring buffer of song pointers whose capacity is
+ * always a power of two so that positions can be masked instead of divided
+ */
+static struct {
+  queue_node **nodes;
+  guint capacity;
+  guint head;
+  guint length;
+  /* changed since the last save */
+  gboolean dirty;
+  guint save_source;
+} queue;
 
-static void queue_add(const gchar *artist, const gchar *title,
-                      const gchar *album, guint length, gint track,
-                      gint64 date);
-static void write_element(gpointer data, G_GNUC_UNUSED gpointer user_data);
+/**
+ * Id for the next song added to the queue, ids are never reused so that
+ * in-flight submissions can refer to songs that have since moved
+ */
+static guint64 next_id = 1;
 
 /**
- * Internal song queue
+ * Whether the cache file or the journal was saved with other endpoints
+ * than the configured ones
  */
-static GQueue *queue;
+static gboolean endpoints_changed;
 
-void queue_init(void) { queue = g_queue_new(); }
+/**
+ * Return the slot of the nth song in the ring buffer
+ */
+#define QUEUE_SLOT(n) (queue.nodes[(queue.head + (n)) & (queue.capacity - 1)])
+
+/**
+ * Size of a regular slab chunk, songs that don't fit get a chunk of their
+ * own
+ */
+#define CHUNK_SIZE 65536
+
+/**
+ * Songs are carved from chunks in the order they are added. As songs
+ * mostly leave the queue in that order too, chunks empty out as a whole
+ * and are freed (or kept as a spare) with their last song.
+ */
+struct queue_chunk {
+  gsize size;
+  gsize used;
+  gsize live;
+  gchar data[];
+};
+
+/**
+ * Each song is preceded by a pointer to its chunk
+ */
+#define SONG_CHUNK(song) (((queue_chunk **)(song))[-1])
+
+/**
+ * Chunk allocator state
+ */
+static struct {
+  queue_chunk *current;
+  queue_chunk *spare;
+} slab;
+
+void queue_init(void) {
+  queue.capacity = 16;
+  queue.nodes = g_malloc(queue.capacity * sizeof(queue_node *));
+  queue.head = 0;
+  queue.length = 0;
+}
 
 void queue_cleanup(void) {
-  g_queue_foreach(queue, queue_free_song, NULL);
-  g_queue_free(queue);
+  // the songs are still queued, don't journal them as removed
+  journal_close();
+  if (queue.save_source > 0)
+    g_source_remove(queue.save_source);
+  queue.save_source = 0;
+  queue_clear_n(queue.length);
+  g_free(queue.nodes);
+  queue.nodes = NULL;
+  queue.capacity = 0;
+
+  g_free(slab.current);
+  g_free(slab.spare);
+  slab.current = slab.spare = NULL;
 }
 
 /**
- * Add a song to the queue
+ * Double the capacity of the ring buffer, unwrapping it in the process
  */
-static void queue_add(const gchar *artist, const gchar *title,
-                      const gchar *album, guint length, gint track,
-                      gint64 date) {
-  queue_node *new_song;
+static void queue_grow(void) {
+  queue_node **nodes = g_malloc(queue.capacity * 2 * sizeof(queue_node *));
+  guint first = MIN(queue.length, queue.capacity - queue.head);
+
+  memcpy(nodes, &queue.nodes[queue.head], first * sizeof(queue_node *));
+  memcpy(&nodes[first], queue.nodes,
+         (queue.length - first) * sizeof(queue_node *));
+
+  g_free(queue.nodes);
+  queue.nodes = nodes;
+  queue.capacity *= 2;
+  queue.head = 0;
+}
 
-  if (!artist || !title || length < 30) {
-    g_debug("Invalid song passed to queue_add(). Rejecting.");
+/**
+ * Remove the first song from the queue
+ */
+static void queue_pop_head(void) {
+  journal_acknowledged(QUEUE_SLOT(0)->id);
+  queue_free_song(QUEUE_SLOT(0));
+  queue.head = (queue.head + 1) & (queue.capacity - 1);
+  queue.length--;
+  queue_changed();
+}
+
+void queue_add(const gchar *artist, const gchar *title, const gchar *album,
+               guint length, gint track, gint64 date) {
+  queue_node *new_song =
+      queue_push(next_id, artist, title, (title ? strlen(title) : 0), album,
+                 length, track, date, 0);
+
+  if (new_song) {
+    TRACE3(queue_add, new_song->id, length, queue.length);
+    next_id++;
+    journal_enqueued(new_song);
+    queue_changed();
+    scmpc_trace("Song added to queue. Queue length: %d", queue.length);
+  }
+}
+
+void queue_restore(guint64 id, const gchar *artist, const gchar *title,
+                   const gchar *album, guint length, gint track, gint64 date,
+                   guint32 acked) {
+  queue_restore_len(id, artist, title, (title ? strlen(title) : 0), album,
+                    length, track, date, acked);
+}
+
+void queue_restore_len(guint64 id, const gchar *artist, const gchar *title,
+                       gsize title_len, const gchar *album, guint length,
+                       gint track, gint64 date, guint32 acked) {
+  // ids must keep growing towards the tail
+  if (queue.length > 0 && id <= QUEUE_SLOT(queue.length - 1)->id)
+    return;
+
+  // left over when an endpoint was removed since the song was saved
+  if (acked && (acked & queue_all_endpoints()) == queue_all_endpoints()) {
+    next_id = MAX(next_id, id + 1);
     return;
   }
 
-  new_song = g_malloc(sizeof(queue_node));
+  if (queue_push(id, artist, title, title_len, album, length, track, date,
+                 acked))
+    next_id = MAX(next_id, id + 1);
+}
 
-  new_song->title = g_strdup(title);
-  new_song->artist = g_strdup(artist);
-  if (album)
-    new_song->album = g_strdup(album);
-  else
-    new_song->album = g_strdup("");
-  new_song->length = length;
-  new_song->track = track;
-  new_song->date = date;
+/**
+ * Append a song with the given id to the queue. The title needn't be
+ * NUL-terminated, it is copied straight into the song.
+ */
+static queue_node *queue_push(guint64 id, const gchar *artist,
+                              const gchar *title, gsize title_len,
+                              const gchar *album, guint length, gint track,
+                              gint64 date, guint32 acked) {
+  queue_node *new_song;
+
+  if (!artist || !title || length < 30) {
+    scmpc_debug("Invalid song passed to queue_add(). Rejecting.");
+    return NULL;
+  }
 
   /* Queue is full, remove the first item and add the new one */
-  if (g_queue_get_length(queue) >= prefs.queue_length) {
-    queue_node *song = g_queue_pop_head(queue);
-    queue_free_song(song, NULL);
+  if (queue.length >= prefs.queue_length && queue.length > 0) {
+    queue_pop_head();
     g_message("The queue of songs to be submitted is too long. "
               "The oldest song has been removed.");
   }
 
-  g_queue_push_tail(queue, new_song);
-  g_debug("Song added to queue. Queue length: %d", g_queue_get_length(queue));
+  if (queue.length == queue.capacity)
+    queue_grow();
+
+  new_song = queue_alloc_song(title_len);
+  QUEUE_SLOT(queue.length) = new_song;
+  new_song->id = id;
+  memcpy(new_song->title, title, title_len);
+  new_song->title[title_len] = '\0';
+  new_song->artist = strpool_intern(artist);
+  new_song->album = strpool_intern(album ? album : "");
+  new_song->length = length;
+  new_song->track = track;
+  new_song->date = date;
+  new_song->queued = get_time();
+  new_song->acked = acked;
+  queue.length++;
+
+  return new_song;
 }
 
-void queue_add_current_song(void) {
-  const gchar *trackstr = mpd_song_get_tag(mpd.song, MPD_TAG_TRACK, 0);
+void queue_add_current_song(mpd_instance *m) {
+  const gchar *trackstr = mpd_song_get_tag(m->song, MPD_TAG_TRACK, 0);
   guint track = 0;
 
   if (trackstr)
     track = strtol(trackstr, NULL, 10);
 
-  queue_add(mpd_song_get_tag(mpd.song, MPD_TAG_ARTIST, 0),
-            mpd_song_get_tag(mpd.song, MPD_TAG_TITLE, 0),
-            mpd_song_get_tag(mpd.song, MPD_TAG_ALBUM, 0),
-            mpd_song_get_duration(mpd.song), track, mpd.song_date);
-  mpd.song_state = SONG_SUBMITTED;
+  queue_add(m->artist, m->title, m->album, mpd_song_get_duration(m->song),
+            track, m->song_date);
+  m->song_state = SONG_SUBMITTED;
 }
 
 void queue_load(void) {
-  gchar line[256], *artist, *album, *title;
-  FILE *cache_file;
-  gint64 date = 0;
-  guint track = 0, length = 0;
-
-  artist = title = album = NULL;
-  g_debug("Loading queue.");
-
-  cache_file = fopen(prefs.cache_file, "r");
-  if (!cache_file) {
-    if (errno != ENOENT)
-      g_message("Failed to open cache file for reading: %s", g_strerror(errno));
+  cache_format format;
+  gboolean replayed;
+
+  scmpc_debug("Loading queue.");
+
+  endpoints_changed = FALSE;
+  format = cache_load(prefs.cache_file);
+  replayed = journal_replay();
+
+  if (endpoints_changed)
+    g_message("The audioscrobbler sections have changed since the queue was "
+              "saved, songs will be submitted to new ones.");
+
+  if (prefs.cache_interval == 0)
     return;
-  }
 
-  while (fgets(line, sizeof line, cache_file)) {
-    *strrchr(line, '\n') = 0;
-    if (!strncmp(line, "# BEGIN SONG", 12)) {
-      artist = title = album = NULL;
-      length = 0;
-    } else if (!strncmp(line, "artist: ", 8)) {
-      g_free(artist);
-      artist = g_strdup(&line[8]);
-    } else if (!strncmp(line, "title: ", 7)) {
-      g_free(title);
-      title = g_strdup(&line[7]);
-    } else if (!strncmp(line, "album: ", 7)) {
-      g_free(album);
-      album = g_strdup(&line[7]);
-    } else if (!strncmp(line, "date: ", 6)) {
-      date = strtol(&line[6], NULL, 10);
-    } else if (!strncmp(line, "length: ", 8)) {
-      length = strtol(&line[8], NULL, 10);
-    } else if (!strncmp(line, "track: ", 7)) {
-      track = strtol(&line[7], NULL, 10);
-    } else if (!strncmp(line, "# END SONG", 10)) {
-      queue_add(artist, title, album, length, track, date);
-      g_free(artist);
-      g_free(title);
-      g_free(album);
-      artist = title = album = NULL;
+  // a fresh snapshot replaces old or broken cache files and saves the
+  // current endpoints
+  if (journal_open(!replayed || format == CACHE_LEGACY ||
+                   format == CACHE_INVALID || endpoints_changed) &&
+      format == CACHE_LEGACY)
+    g_message("Converted %s to the binary cache format.", prefs.cache_file);
+}
+
+/**
+ * Carve a song with room for a title of title_len bytes from the current
+ * chunk, starting a new one if it is full
+ */
+static queue_node *queue_alloc_song(gsize title_len) {
+  gsize size = sizeof(queue_chunk *) + sizeof(queue_node) + title_len + 1;
+  queue_chunk *chunk = slab.current;
+  gchar *p;
+
+  // keep the next song 8 byte aligned
+  size = (size + 7) & ~(gsize)7;
+
+  if (size > CHUNK_SIZE) {
+    chunk = g_malloc(sizeof(queue_chunk) + size);
+    chunk->size = size;
+    chunk->used = chunk->live = 0;
+  } else if (!chunk || chunk->used + size > chunk->size) {
+    // the old chunk is freed once its last song is gone
+    if (slab.spare) {
+      chunk = slab.spare;
+      slab.spare = NULL;
+    } else {
+      chunk = g_malloc(sizeof(queue_chunk) + CHUNK_SIZE);
+      chunk->size = CHUNK_SIZE;
     }
+    chunk->used = chunk->live = 0;
+    slab.current = chunk;
   }
-  g_free(artist);
-  g_free(title);
-  g_free(album);
-  fclose(cache_file);
-}
 
-void queue_free_song(gpointer data, G_GNUC_UNUSED gpointer user_data) {
-  queue_node *song = data;
-  g_free(song->album);
-  g_free(song->artist);
-  g_free(song->title);
-  g_free(song);
+  p = chunk->data + chunk->used;
+  chunk->used += size;
+  chunk->live++;
+
+  *(queue_chunk **)p = chunk;
+  return (queue_node *)(p + sizeof(queue_chunk *));
 }
 
-gboolean queue_save(G_GNUC_UNUSED gpointer data) {
-  FILE *cache_file = fopen(prefs.cache_file, "w");
+/**
+ * Release the strings of a song and give its memory back to the chunk
+ */
+static void queue_free_song(queue_node *song) {
+  queue_chunk *chunk = SONG_CHUNK(song);
 
-  if (!cache_file) {
-    g_warning("Failed to open cache file for writing: %s", g_strerror(errno));
-    return FALSE;
-  }
+  strpool_unref(song->album);
+  strpool_unref(song->artist);
 
-  g_queue_foreach(queue, write_element, cache_file);
+  if (--chunk->live == 0)
+    queue_release_chunk(chunk);
+}
 
-  fclose(cache_file);
-  g_debug("Cache saved.");
-  return TRUE;
+/**
+ * Recycle a chunk without songs, keeping one spare around so that a queue
+ * that is filled and drained continuously doesn't hit malloc
+ */
+static void queue_release_chunk(queue_chunk *chunk) {
+  if (chunk == slab.current) {
+    chunk->used = 0;
+  } else if (!slab.spare && chunk->size == CHUNK_SIZE) {
+    slab.spare = chunk;
+  } else {
+    g_free(chunk);
+  }
 }
 
 /**
- * Write a song to the cache file
+ * Note that the queue needs saving and schedule a save, the first change
+ * after a save starts the cache_interval
  */
-static void write_element(gpointer data, gpointer user_data) {
-  FILE *cache_file = user_data;
-  queue_node *song = data;
+static void queue_changed(void) {
+  queue.dirty = TRUE;
+  if (queue.save_source == 0 && prefs.cache_interval > 0)
+    queue.save_source = g_timeout_add_seconds(prefs.cache_interval * 60,
+                                              queue_save_timeout, NULL);
+}
 
-  fprintf(cache_file, "# BEGIN SONG\n"
-                      "artist: %s\n"
-                      "title: %s\n"
-                      "album: %s\n"
-                      "length: %d\n"
-                      "track: %d\n"
-                      "date: %" G_GINT64_FORMAT "\n"
-                      "# END SONG\n\n",
-          song->artist, song->title, song->album, song->length, song->track,
-          song->date);
+static gboolean queue_save_timeout(G_GNUC_UNUSED gpointer data) {
+  count_wakeup(WAKEUP_CACHE_SAVE);
+  queue.save_source = 0;
+  queue_save();
+  return FALSE;
+}
+
+void queue_save(void) {
+  strpool_stats stats;
+
+  if (queue.save_source > 0)
+    g_source_remove(queue.save_source);
+  queue.save_source = 0;
+  if (!queue.dirty)
+    return;
+  queue.dirty = FALSE;
+
+  journal_checkpoint();
+  scmpc_debug("Cache saved.");
+
+  strpool_get_stats(&stats);
+  scmpc_debug("String pool: %u strings, %" G_GUINT64_FORMAT " references, "
+              "%" G_GSIZE_FORMAT " bytes, %" G_GSIZE_FORMAT " bytes saved.",
+              stats.strings, stats.refs, stats.bytes, stats.saved);
 }
 
 void queue_clear_n(guint num) {
-  if (num > g_queue_get_length(queue))
-    num = g_queue_get_length(queue);
+  if (num > queue.length)
+    num = queue.length;
+  TRACE2(queue_clear, num, (num > 0 ? QUEUE_SLOT(0)->id : 0));
+
+  for (guint i = 0; i < num; i++)
+    queue_pop_head();
+}
+
+guint queue_get_length(void) { return queue.length; }
+
+queue_node *queue_peek_head(void) { return queue_peek_nth(0); }
+
+queue_node *queue_peek_nth(guint n) {
+  if (n >= queue.length)
+    return NULL;
+  return QUEUE_SLOT(n);
+}
+
+guint queue_peek_range(guint start, guint n, queue_view *view) {
+  guint first;
 
-  for (guint i = 0; i < num; i++) {
-    queue_node *song = g_queue_pop_head(queue);
-    queue_free_song(song, NULL);
+  if (start >= queue.length) {
+    view->first = view->second = NULL;
+    view->first_len = view->second_len = 0;
+    return 0;
   }
+
+  n = MIN(n, queue.length - start);
+  first = queue.capacity - ((queue.head + start) & (queue.capacity - 1));
+  first = MIN(n, first);
+
+  view->first = &QUEUE_SLOT(start);
+  view->first_len = first;
+  view->second = (n > first ? queue.nodes : NULL);
+  view->second_len = n - first;
+
+  return n;
 }
 
-guint queue_get_length(void) { return g_queue_get_length(queue); }
+guint queue_find_id(guint64 id) {
+  guint low = 0, high = queue.length;
 
-queue_node *queue_peek_head(void) { return g_queue_peek_head(queue); }
+  // ids only ever grow towards the tail
+  while (low < high) {
+    guint mid = low + (high - low) / 2;
+    if (QUEUE_SLOT(mid)->id < id)
+      low = mid + 1;
+    else
+      high = mid;
+  }
 
-queue_node *queue_peek_nth(guint n) { return g_queue_peek_nth(queue, n); }
+  return low;
+}
+
+void queue_remove_id(guint64 id) {
+  guint pos = queue_find_id(id);
+
+  if (pos >= queue.length || QUEUE_SLOT(pos)->id != id)
+    return;
+
+  journal_acknowledged(id);
+  queue_free_song(QUEUE_SLOT(pos));
+  queue_changed();
+
+  // close the gap from whichever end is closer
+  if (pos < queue.length / 2) {
+    for (guint i = pos; i > 0; i--)
+      QUEUE_SLOT(i) = QUEUE_SLOT(i - 1);
+    queue.head = (queue.head + 1) & (queue.capacity - 1);
+  } else {
+    for (guint i = pos; i + 1 < queue.length; i++)
+      QUEUE_SLOT(i) = QUEUE_SLOT(i + 1);
+  }
+  queue.length--;
+  TRACE2(queue_remove, id, queue.length);
+}
+
+void queue_acknowledge(guint64 id, guint endpoint) {
+  guint pos = queue_find_id(id);
+  guint32 all = queue_all_endpoints();
+  queue_node *song;
+
+  if (pos >= queue.length || (song = QUEUE_SLOT(pos))->id != id)
+    return;
+
+  song->acked |= 1u << endpoint;
+  if ((song->acked & all) == all) {
+    queue_remove_id(id);
+  } else {
+    journal_endpoint_acknowledged(id, endpoint);
+    queue_changed();
+  }
+}
+
+gchar *queue_endpoint_key(guint endpoint) {
+  const as_server *server = &prefs.as_servers[endpoint];
+
+  // an empty url is Last.fm
+  return g_strdup_printf("%s %s", server->url, server->username);
+}
+
+void queue_map_endpoints(queue_endpoint_map *map, const gchar *const *keys,
+                         guint count) {
+  guint32 used = 0;
+
+  map->count = MIN(count, QUEUE_MAX_ENDPOINTS);
+  for (guint i = 0; i < map->count; i++) {
+    map->bits[i] = 0;
+    for (guint j = 0; keys[i] && j < prefs.as_count; j++) {
+      gchar *key;
+
+      if (used & (1u << j))
+        continue;
+      key = queue_endpoint_key(j);
+      if (!strcmp(key, keys[i]))
+        map->bits[i] = 1u << j;
+      g_free(key);
+      if (map->bits[i])
+        break;
+    }
+    used |= map->bits[i];
+    if (map->bits[i] != 1u << i)
+      endpoints_changed = TRUE;
+  }
+
+  if (map->count != prefs.as_count)
+    endpoints_changed = TRUE;
+}
+
+guint32 queue_map_acked(const queue_endpoint_map *map, guint32 acked) {
+  guint32 mapped = 0;
+
+  for (guint i = 0; i < map->count; i++) {
+    if (acked & (1u << i))
+      mapped |= map->bits[i];
+  }
+  return mapped;
+}
+
+/**
+ * Return the acked bits of all configured endpoints
+ */
+static guint32 queue_all_endpoints(void) {
+  return (prefs.as_count >= QUEUE_MAX_ENDPOINTS ? G_MAXUINT32
+                                                : (1u << prefs.as_count) - 1);
+}
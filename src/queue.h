@@ -28,22 +28,112 @@
 
 #include <glib.h>
 
+struct mpd_instance;
+
+/**
+ * Maximum number of scrobbling endpoints, one bit each in
+ * queue_node.acked
+ */
+#define QUEUE_MAX_ENDPOINTS 32
+
 /**
- * An element in the song queue
+ * An element in the song queue. Songs are variable-length records with the
+ * title stored inline, artist and album belong to the string pool.
  */
 typedef struct {
-  gchar *album;
-  gchar *artist;
-  gchar *title;
+  guint64 id;
+  const gchar *album;
+  const gchar *artist;
   gint64 date;
+  /* when the song entered the queue, for latency accounting */
+  gint64 queued;
   guint length;
   guint track;
+  /* endpoints that already have the song, one bit each */
+  guint32 acked;
+  gchar title[];
 } queue_node;
 
 /**
- * Add the currently playing song to the queue
+ * Translates the bits of queue_node.acked saved by an earlier run to the
+ * endpoints configured now, bits[i] is the bit of saved endpoint i or 0 if
+ * it is gone
+ */
+typedef struct {
+  guint32 bits[QUEUE_MAX_ENDPOINTS];
+  guint count;
+} queue_endpoint_map;
+
+/**
+ * A read-only view of a range of consecutive songs. The range may wrap
+ * around the end of the ring buffer, so it consists of up to two arrays.
+ * It is only valid until the queue is modified.
+ */
+typedef struct {
+  queue_node **first;
+  guint first_len;
+  queue_node **second;
+  guint second_len;
+} queue_view;
+
+/**
+ * Return the nth song of a #queue_view
+ */
+static inline queue_node *queue_view_nth(const queue_view *view, guint n) {
+  if (n < view->first_len)
+    return view->first[n];
+  return view->second[n - view->first_len];
+}
+
+/**
+ * Add a song to the queue, dropping the oldest one if it is full
+ */
+void queue_add(const gchar *artist, const gchar *title, const gchar *album,
+               guint length, gint track, gint64 date);
+
+/**
+ * Add a song with a known id and the endpoints that have already
+ * acknowledged it, used when replaying the journal. Songs whose id isn't
+ * larger than that of the last song and songs that every endpoint has
+ * acknowledged are ignored.
+ */
+void queue_restore(guint64 id, const gchar *artist, const gchar *title,
+                   const gchar *album, guint length, gint track, gint64 date,
+                   guint32 acked);
+
+/**
+ * Like #queue_restore, but the title is passed with its length and needn't
+ * be NUL-terminated, so it can be copied straight out of a mapped file.
+ * Artist and album are interned like in #queue_add, which only takes a
+ * reference if the loader pooled them already.
+ */
+void queue_restore_len(guint64 id, const gchar *artist, const gchar *title,
+                       gsize title_len, const gchar *album, guint length,
+                       gint track, gint64 date, guint32 acked);
+
+/**
+ * Return the key that identifies an endpoint in the cache file and the
+ * journal, its url and username, so that reordering or renaming sections
+ * keeps what it has acknowledged. Free it with g_free().
  */
-void queue_add_current_song(void);
+gchar *queue_endpoint_key(guint endpoint);
+
+/**
+ * Fill map for acked bits that were saved with the endpoints in keys. If
+ * they differ from the configured ones, #queue_load writes a new snapshot.
+ */
+void queue_map_endpoints(queue_endpoint_map *map, const gchar *const *keys,
+                         guint count);
+
+/**
+ * Translate saved acked bits with map
+ */
+guint32 queue_map_acked(const queue_endpoint_map *map, guint32 acked);
+
+/**
+ * Add the song currently playing on an MPD server to the queue
+ */
+void queue_add_current_song(struct mpd_instance *instance);
 
 /**
  * Release resources
@@ -61,19 +151,16 @@ void queue_clear_n(guint num);
 void queue_init(void);
 
 /**
- * Free the memory used by a #queue_node
- */
-void queue_free_song(gpointer song, G_GNUC_UNUSED gpointer user_data);
-
-/**
- * Load the queue from the cache file
+ * Load the queue from the cache file and the journal, converting old text
+ * cache files, and start journaling changes
  */
 void queue_load(void);
 
 /**
- * Save the queue to the cache file
+ * Sync the journal to disk and compact it if needed. Nothing is done if the
+ * queue hasn't changed since the last save.
  */
-gboolean queue_save(gpointer data);
+void queue_save(void);
 
 /**
  * Get the current queue length
@@ -86,8 +173,32 @@ guint queue_get_length(void);
 queue_node *queue_peek_head(void);
 
 /**
- * Return the nth song from the queue, but don't remove it
+ * Return the nth song from the queue, but don't remove it. The pointer is
+ * only valid until the queue is modified.
  */
 queue_node *queue_peek_nth(guint n);
 
+/**
+ * Fill view with up to n songs starting at position start and return the
+ * number of songs in it
+ */
+guint queue_peek_range(guint start, guint n, queue_view *view);
+
+/**
+ * Return the position of the first song whose id is at least id, or the
+ * queue length if there is none
+ */
+guint queue_find_id(guint64 id);
+
+/**
+ * Remove the song with the given id from the queue, if it is still there
+ */
+void queue_remove_id(guint64 id);
+
+/**
+ * Record that an endpoint has the song with the given id. The song is
+ * removed once all endpoints have it.
+ */
+void queue_acknowledge(guint64 id, guint endpoint);
+
 #endif /* HAVE_QUEUE_H */
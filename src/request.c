@@ -0,0 +1,246 @@
+/**
+ * request.c: Signed Last.fm web service requests.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "log.h"
+#include "request.h"
+
+/**
+ * Initial buffer size, a full batch of scrobbles usually fits
+ */
+#define REQUEST_BUFFER_SIZE 4096
+
+static request_param *request_param_new(request *req, const gchar *value);
+static void request_reserve(request *req, gsize length);
+static void request_append(request *req, const gchar *str, gsize length);
+static void request_append_escaped(request *req, const gchar *str);
+
+void request_init(request *req) {
+  memset(req, 0, sizeof(request));
+  req->checksum = g_checksum_new(G_CHECKSUM_MD5);
+  req->size = REQUEST_BUFFER_SIZE;
+  req->buf = g_malloc(req->size);
+  req->buf[0] = '\0';
+}
+
+void request_clear(request *req) {
+  if (req->checksum)
+    g_checksum_free(req->checksum);
+  g_free(req->buf);
+  memset(req, 0, sizeof(request));
+}
+
+void request_start(request *req, const gchar *url) {
+  req->num = 0;
+  req->len = 0;
+  req->allocs = 0;
+
+  // the last buffer was stolen and not handed back yet
+  if (!req->buf) {
+    req->buf = g_malloc(req->size);
+    req->allocs++;
+  }
+  req->buf[0] = '\0';
+  g_checksum_reset(req->checksum);
+
+  if (url) {
+    request_append(req, url, strlen(url));
+    request_append(req, "?", 1);
+  }
+  req->start = req->len;
+}
+
+void request_add(request *req, const gchar *name, const gchar *value) {
+  request_param *param;
+
+  if (!value)
+    return;
+
+  param = request_param_new(req, value);
+  if (param)
+    g_strlcpy(param->name, name, REQUEST_NAME_SIZE);
+}
+
+void request_add_uint(request *req, const gchar *name, guint64 value) {
+  request_param *param = request_param_new(req, NULL);
+
+  if (!param)
+    return;
+  g_strlcpy(param->name, name, REQUEST_NAME_SIZE);
+  g_snprintf(param->number, sizeof(param->number), "%" G_GUINT64_FORMAT,
+             value);
+  param->value = param->number;
+}
+
+void request_add_item(request *req, const gchar *name, guint index,
+                      const gchar *value) {
+  request_param *param;
+
+  if (!value)
+    return;
+
+  param = request_param_new(req, value);
+  if (param)
+    g_snprintf(param->name, REQUEST_NAME_SIZE, "%s[%u]", name, index);
+}
+
+void request_add_item_uint(request *req, const gchar *name, guint index,
+                           guint64 value) {
+  request_param *param = request_param_new(req, NULL);
+
+  if (!param)
+    return;
+  g_snprintf(param->name, REQUEST_NAME_SIZE, "%s[%u]", name, index);
+  g_snprintf(param->number, sizeof(param->number), "%" G_GUINT64_FORMAT,
+             value);
+  param->value = param->number;
+}
+
+const gchar *request_finish(request *req, const gchar *secret) {
+  guint i, pos;
+
+  // insertion sort, callers add parameters mostly in order
+  for (i = 0; i < req->num; i++) {
+    request_param *param = &req->params[i];
+
+    for (pos = i;
+         pos > 0 && strcmp(req->sorted[pos - 1]->name, param->name) > 0; pos--)
+      req->sorted[pos] = req->sorted[pos - 1];
+    req->sorted[pos] = param;
+  }
+
+  for (i = 0; i < req->num; i++) {
+    const request_param *param = req->sorted[i];
+    gsize name_len = strlen(param->name);
+
+    // the signature is every name and value in order, then the secret
+    g_checksum_update(req->checksum, (const guchar *)param->name, name_len);
+    g_checksum_update(req->checksum, (const guchar *)param->value, -1);
+
+    if (req->len > req->start)
+      request_append(req, "&", 1);
+    request_append(req, param->name, name_len);
+    request_append(req, "=", 1);
+    request_append_escaped(req, param->value);
+  }
+  g_checksum_update(req->checksum, (const guchar *)secret, -1);
+
+  if (req->len > req->start)
+    request_append(req, "&", 1);
+  request_append(req, "api_sig=", 8);
+  request_append(req, g_checksum_get_string(req->checksum), 32);
+
+#ifdef DEBUG
+  scmpc_trace("Built request with %u parameters, %" G_GSIZE_FORMAT
+              " bytes and %u allocations.",
+              req->num, req->len, req->allocs);
+#endif
+  return req->buf;
+}
+
+gchar *request_steal(request *req, gsize *size) {
+  gchar *buf = req->buf;
+
+  *size = req->size;
+  req->buf = NULL;
+  req->len = 0;
+  return buf;
+}
+
+void request_recycle(request *req, gchar *buf, gsize size) {
+  // a buffer smaller than the request has grown to since is of no use
+  if (req->buf || size < req->size) {
+    g_free(buf);
+    return;
+  }
+  req->buf = buf;
+  req->size = size;
+}
+
+/**
+ * Take the next free parameter, returns NULL if there are too many
+ */
+static request_param *request_param_new(request *req, const gchar *value) {
+  request_param *param;
+
+  g_return_val_if_fail(req->num < REQUEST_MAX_PARAMS, NULL);
+
+  param = &req->params[req->num++];
+  param->value = value;
+  return param;
+}
+
+/**
+ * Make room for length more bytes and the terminating NUL
+ */
+static void request_reserve(request *req, gsize length) {
+  if (req->len + length < req->size)
+    return;
+
+  while (req->len + length >= req->size)
+    req->size *= 2;
+  req->buf = g_realloc(req->buf, req->size);
+  req->allocs++;
+}
+
+static void request_append(request *req, const gchar *str, gsize length) {
+  request_reserve(req, length);
+  memcpy(req->buf + req->len, str, length);
+  req->len += length;
+  req->buf[req->len] = '\0';
+}
+
+/**
+ * Append str percent-encoded, everything but unreserved characters
+ * (RFC 3986) is escaped
+ */
+static void request_append_escaped(request *req, const gchar *str) {
+  static const gchar hex[] = "0123456789ABCDEF";
+  gsize length = strlen(str);
+  gchar *out;
+
+  // worst case, every byte is escaped
+  request_reserve(req, length * 3);
+  out = req->buf + req->len;
+
+  for (; *str; str++) {
+    guchar c = *str;
+
+    if (g_ascii_isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+      *out++ = c;
+    } else {
+      *out++ = '%';
+      *out++ = hex[c >> 4];
+      *out++ = hex[c & 0x0f];
+    }
+  }
+  req->len = out - req->buf;
+  req->buf[req->len] = '\0';
+}
@@ -0,0 +1,126 @@
+/**
+ * request.h: Signed Last.fm web service requests.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_REQUEST_H
+#define HAVE_REQUEST_H
+
+#include <glib.h>
+
+/**
+ * Most parameters in a request, enough for a full batch of scrobbles
+ */
+#define REQUEST_MAX_PARAMS 80
+
+/**
+ * Longest parameter name, including the array index
+ */
+#define REQUEST_NAME_SIZE 24
+
+/**
+ * A parameter, numbers are formatted into the parameter itself
+ */
+typedef struct {
+  gchar name[REQUEST_NAME_SIZE];
+  const gchar *value;
+  gchar number[24];
+} request_param;
+
+/**
+ * A request being built. #request_finish sorts the parameters by name,
+ * then signs and encodes them in a single pass. The checksum and buffer
+ * are reused from one request to the next.
+ */
+typedef struct {
+  request_param params[REQUEST_MAX_PARAMS];
+  request_param *sorted[REQUEST_MAX_PARAMS];
+  guint num;
+  GChecksum *checksum;
+  gchar *buf;
+  gsize len;
+  gsize size;
+  /* where the parameters start after the URL of a GET request */
+  gsize start;
+  /* allocations made for the current request */
+  guint allocs;
+} request;
+
+/**
+ * Allocate the checksum and buffer of a request
+ */
+void request_init(request *req);
+
+/**
+ * Free the checksum and buffer of a request
+ */
+void request_clear(request *req);
+
+/**
+ * Start a new request, the parameters follow url and a question mark if it
+ * is not NULL
+ */
+void request_start(request *req, const gchar *url);
+
+/**
+ * Add a parameter, value is not copied and has to stay around until
+ * #request_finish. NULL values are skipped.
+ */
+void request_add(request *req, const gchar *name, const gchar *value);
+
+/**
+ * Add a numeric parameter
+ */
+void request_add_uint(request *req, const gchar *name, guint64 value);
+
+/**
+ * Add an element of an array parameter, name[index]
+ */
+void request_add_item(request *req, const gchar *name, guint index,
+                      const gchar *value);
+
+/**
+ * Add a numeric element of an array parameter
+ */
+void request_add_item_uint(request *req, const gchar *name, guint index,
+                           guint64 value);
+
+/**
+ * Sign the parameters with secret and write them URL-encoded, followed by
+ * api_sig. The result stays valid until the next #request_start.
+ */
+const gchar *request_finish(request *req, const gchar *secret);
+
+/**
+ * Take over the buffer of a finished request, so that it can be sent while
+ * the next one is built. size is set to its allocated size.
+ */
+gchar *request_steal(request *req, gsize *size);
+
+/**
+ * Hand back a buffer from #request_steal once it has been sent, it is
+ * reused if the request doesn't have one
+ */
+void request_recycle(request *req, gchar *buf, gsize size);
+
+#endif /* HAVE_REQUEST_H */
@@ -28,14 +28,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <mpd/client.h>
 
 #include "audioscrobbler.h"
+#include "log.h"
+#include "metrics.h"
 #include "misc.h"
 #include "mpd.h"
 #include "preferences.h"
 #include "queue.h"
 #include "scmpc.h"
+#include "strpool.h"
+#include "trace.h"
 
 /* Static function prototypes */
 static gint scmpc_is_running(void);
@@ -54,16 +62,12 @@ static void close_signal_pipe(void);
 static int signal_pipe[2] = {-1, -1};
 
 static void daemonise(void);
-static gboolean current_song_eligible_for_submission(void);
+static gboolean current_song_eligible_for_submission(mpd_instance *m);
 
 /**
  * GSource for UNIX signals
  */
 static guint signal_source;
-/**
- * Timeout source for the queue save interval
- */
-static guint cache_save_source;
 /**
  * scmpc's main event loop
  */
@@ -92,6 +96,9 @@ int main(int argc, char *argv[]) {
   if (prefs.fork)
     daemonise();
 
+  // from here on messages are written in the background
+  start_log_writer();
+
   /* Signal handler */
   open_signal_pipe();
   sa.sa_handler = sighandler;
@@ -100,35 +107,24 @@ int main(int argc, char *argv[]) {
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
   sigaction(SIGQUIT, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
 
   if (as_connection_init() == FALSE) {
     scmpc_cleanup();
     exit(EXIT_FAILURE);
   }
+  // the loaded queue is submitted as soon as authentication succeeds
   as_authenticate();
 
   queue_init();
   queue_load();
 
-  // submit the loaded queue
-  as_check_submit();
+  mpd_init();
 
-  mpd.song_pos = g_timer_new();
-  mpd.idle_source = 0;
-  if (!mpd_connect()) {
-    mpd_disconnect();
-    mpd_schedule_reconnect();
-  }
+  metrics_init();
 
-  // set up main loop events
+  // set up main loop events, the queue schedules its own saves
   loop = g_main_loop_new(NULL, FALSE);
-
-  // save queue
-  if (prefs.cache_interval > 0) {
-    cache_save_source =
-        g_timeout_add_seconds(prefs.cache_interval * 60, queue_save, NULL);
-  }
-
   g_main_loop_run(loop);
 
   scmpc_cleanup();
@@ -266,11 +262,18 @@ static gboolean signal_parse(GIOChannel *source,
                              G_GNUC_UNUSED gpointer data) {
   gint fd = g_io_channel_unix_get_fd(source);
   gchar sig;
+
+  count_wakeup(WAKEUP_SIGNAL);
   if (read(fd, &sig, 1) < 0) {
     g_message("Reading from signal pipe failed, re-opening pipe.");
     close_signal_pipe();
     open_signal_pipe();
     return TRUE;
+  } else if (sig == SIGHUP) {
+    // the log was rotated
+    reopen_log();
+    g_message("Caught signal %hhd, reopened log file.", sig);
+    return TRUE;
   } else {
     g_message("Caught signal %hhd, exiting.", sig);
     scmpc_shutdown();
@@ -312,29 +315,31 @@ void scmpc_shutdown(void) {
  */
 static void scmpc_cleanup(void) {
   g_source_remove(signal_source);
-  if (prefs.cache_interval > 0)
-    g_source_remove(cache_save_source);
-  if (mpd.idle_source > 0)
-    g_source_remove(mpd.idle_source);
-  if (mpd.check_source > 0)
-    g_source_remove(mpd.check_source);
-  if (mpd.reconnect_source > 0)
-    g_source_remove(mpd.reconnect_source);
-
-  if (current_song_eligible_for_submission() && prefs.queue_length > 0)
-    queue_add_current_song();
+  metrics_cleanup();
+  for (guint i = 0; i < mpd.count; i++) {
+    mpd_instance *m = &mpd.instances[i];
+
+    if (m->idle_source > 0)
+      g_source_remove(m->idle_source);
+    if (m->check_source > 0)
+      g_source_remove(m->check_source);
+    backoff_reset(&m->reconnect);
+
+    if (current_song_eligible_for_submission(m) && prefs.queue_length > 0)
+      queue_add_current_song(m);
+  }
   if (prefs.fork)
     scmpc_pid_remove();
   close_signal_pipe();
+  // finished submissions are acknowledged before the queue is saved
+  as_cleanup();
   if (prefs.cache_interval > 0)
-    queue_save(NULL);
+    queue_save();
   queue_cleanup();
-  if (mpd.song_pos)
-    g_timer_destroy(mpd.song_pos);
+  mpd_cleanup();
+  strpool_cleanup();
+  stop_log_writer();
   clear_preferences();
-  as_cleanup();
-  if (mpd.conn != NULL)
-    mpd_connection_free(mpd.conn);
 }
 
 void kill_scmpc(void) {
@@ -354,24 +359,32 @@ void kill_scmpc(void) {
 }
 
 /**
- * Check if the current song is eligible for submission
+ * Check if the song playing on an MPD server is eligible for submission
  */
-static gboolean current_song_eligible_for_submission(void) {
-  if (!mpd.song)
+static gboolean current_song_eligible_for_submission(mpd_instance *m) {
+  if (!m->song)
     return FALSE;
 
-  return (mpd.song_state != SONG_SUBMITTED &&
-          (g_timer_elapsed(mpd.song_pos, NULL) >= 240 ||
-           g_timer_elapsed(mpd.song_pos, NULL) >=
-               mpd_song_get_duration(mpd.song) * 0.5));
+  return (m->song_state != SONG_SUBMITTED &&
+          mpd_song_elapsed(m) >= mpd_song_threshold(m));
 }
 
-gboolean scmpc_check(G_GNUC_UNUSED gpointer data) {
-  if (current_song_eligible_for_submission() && prefs.queue_length > 0) {
-    queue_add_current_song();
-    return FALSE; // remove from main event loop
+gboolean scmpc_check(gpointer data) {
+  mpd_instance *m = data;
+  gboolean eligible = current_song_eligible_for_submission(m);
+
+  count_wakeup(WAKEUP_MPD_CHECK);
+  TRACE4(song_check, m->server->name,
+         (m->song ? mpd_song_get_id(m->song) : 0), mpd_song_elapsed(m),
+         eligible);
+
+  // mpd_schedule_check() sets up a new timeout if needed
+  m->check_source = 0;
+  if (eligible && prefs.queue_length > 0) {
+    queue_add_current_song(m);
+    as_schedule_submit();
+  } else if (!eligible) {
+    mpd_schedule_check(m);
   }
-
-  // TODO don't return true, reschedule this properly
-  return TRUE;
+  return FALSE;
 }
@@ -39,7 +39,9 @@ void kill_scmpc(void);
 void scmpc_shutdown(void);
 
 /**
- * Check if a song is eligible for submission and add it to the queue
+ * Check if the song playing on the MPD instance data is eligible for
+ * submission and add it to the queue. This is a one-shot timeout set up
+ * by #mpd_schedule_check.
  */
 gboolean scmpc_check(gpointer data);
 
@@ -0,0 +1,148 @@
+/**
+ * strpool.c: Shared pool of interned strings.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <string.h>
+
+#include "strpool.h"
+
+/**
+ * A pooled string, the header sits right in front of the characters so
+ * that a string can be mapped back to its entry without a lookup
+ */
+typedef struct {
+  guint refcount;
+  guint len;
+  gchar str[];
+} strpool_entry;
+
+#define STRPOOL_ENTRY(s)                                                       \
+  ((strpool_entry *)((gchar *)(s)-G_STRUCT_OFFSET(strpool_entry, str)))
+
+/**
+ * Pool state, the table maps each string to its entry
+ */
+static struct {
+  GHashTable *table;
+  guint64 refs;
+  gsize bytes;
+  gsize saved;
+} pool;
+
+const gchar *strpool_intern(const gchar *str) {
+  strpool_entry *entry;
+  gsize len;
+
+  if (!str)
+    return NULL;
+
+  if (!pool.table)
+    pool.table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+
+  entry = g_hash_table_lookup(pool.table, str);
+  if (entry)
+    return strpool_ref(entry->str);
+
+  len = strlen(str);
+  entry = g_malloc(sizeof(strpool_entry) + len + 1);
+  entry->refcount = 1;
+  entry->len = len;
+  memcpy(entry->str, str, len + 1);
+  g_hash_table_insert(pool.table, entry->str, entry);
+
+  pool.refs++;
+  pool.bytes += sizeof(strpool_entry) + len + 1;
+  return entry->str;
+}
+
+const gchar *strpool_intern_len(const gchar *str, gsize len) {
+  strpool_entry *entry, *found;
+
+  if (!pool.table)
+    pool.table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+
+  // build the entry first, it is the NUL-terminated key for the lookup
+  entry = g_malloc(sizeof(strpool_entry) + len + 1);
+  memcpy(entry->str, str, len);
+  entry->str[len] = '\0';
+
+  found = g_hash_table_lookup(pool.table, entry->str);
+  if (found) {
+    g_free(entry);
+    return strpool_ref(found->str);
+  }
+
+  // a NUL in the middle cuts the string short, as strpool_intern() would
+  len = strlen(entry->str);
+  entry->refcount = 1;
+  entry->len = len;
+  g_hash_table_insert(pool.table, entry->str, entry);
+
+  pool.refs++;
+  pool.bytes += sizeof(strpool_entry) + len + 1;
+  return entry->str;
+}
+
+const gchar *strpool_ref(const gchar *str) {
+  strpool_entry *entry = STRPOOL_ENTRY(str);
+
+  entry->refcount++;
+  pool.refs++;
+  pool.saved += entry->len + 1;
+  return str;
+}
+
+void strpool_unref(const gchar *str) {
+  strpool_entry *entry;
+
+  if (!str)
+    return;
+
+  entry = STRPOOL_ENTRY(str);
+  pool.refs--;
+  if (--entry->refcount > 0) {
+    pool.saved -= entry->len + 1;
+    return;
+  }
+
+  pool.bytes -= sizeof(strpool_entry) + entry->len + 1;
+  // frees the entry
+  g_hash_table_remove(pool.table, entry->str);
+}
+
+void strpool_get_stats(strpool_stats *stats) {
+  stats->strings = (pool.table ? g_hash_table_size(pool.table) : 0);
+  stats->refs = pool.refs;
+  stats->bytes = pool.bytes;
+  stats->saved = pool.saved;
+}
+
+void strpool_cleanup(void) {
+  if (pool.table)
+    g_hash_table_destroy(pool.table);
+  pool.table = NULL;
+  pool.refs = 0;
+  pool.bytes = 0;
+  pool.saved = 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * strpool.h: Shared pool of interned strings.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_STRPOOL_H
+#define HAVE_STRPOOL_H
+
+#include <glib.h>
+
+/**
+ * Memory statistics of the pool
+ */
+typedef struct {
+  guint strings;
+  guint64 refs;
+  gsize bytes;
+  gsize saved;
+} strpool_stats;
+
+/**
+ * Return the pooled copy of str with its reference count increased, adding
+ * it to the pool if necessary. NULL is passed through.
+ */
+const gchar *strpool_intern(const gchar *str);
+
+/**
+ * Like #strpool_intern, for len bytes at str that needn't be NUL-terminated.
+ * A new string is copied once, straight into its pool entry.
+ */
+const gchar *strpool_intern_len(const gchar *str, gsize len);
+
+/**
+ * Take another reference to a pooled string
+ */
+const gchar *strpool_ref(const gchar *str);
+
+/**
+ * Drop a reference to a pooled string, freeing it with the last one. NULL
+ * is ignored.
+ */
+void strpool_unref(const gchar *str);
+
+/**
+ * Fill stats with the current pool statistics
+ */
+void strpool_get_stats(strpool_stats *stats);
+
+/**
+ * Free all pooled strings, whether they are still referenced or not
+ */
+void strpool_cleanup(void);
+
+#endif /* HAVE_STRPOOL_H */
@@ -0,0 +1,81 @@
+/**
+ * trace.h: Static tracepoints.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_TRACE_H
+#define HAVE_TRACE_H
+
+/**
+ * USDT probes of the provider "scmpc", for perf, bpftrace or SystemTap.
+ * A probe is a single nop until a tracer attaches to it, its arguments are
+ * only read then. Without <sys/sdt.h> they compile to nothing and the
+ * arguments aren't evaluated at all.
+ *
+ * Songs are identified by their MPD song id until they are queued and by
+ * their queue id from then on. Request types are 0 for
+ * auth.getMobileSession, 1 for track.updateNowPlaying and 2 for
+ * track.scrobble.
+ *
+ *   song_change(server, mpd_id, duration)
+ *       MPD started playing a new song
+ *   song_check(server, mpd_id, elapsed_ms, eligible)
+ *       The current song was checked for submission
+ *   queue_add(id, duration, queue_length)
+ *   queue_remove(id, queue_length)
+ *       A song was acknowledged by every endpoint
+ *   queue_clear(num, first_id)
+ *   build_start(type, first_id, num)
+ *   build_end(type, num, bytes)
+ *       A request was signed and encoded, on the worker thread
+ *   request_start(type, first_id, num)
+ *   request_end(type, first_id, curl_result, bytes)
+ *       cURL ran a request, on the worker thread
+ *   response(type, first_id, curl_result, lfm_status, usec)
+ *       A response is handled on the main thread
+ *   submit_result(server, first_id, removed, retry)
+ *       Songs of a submission were acknowledged or kept for a retry
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define TRACE2(name, a, b) DTRACE_PROBE2(scmpc, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(scmpc, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(scmpc, name, a, b, c, d)
+#define TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(scmpc, name, a, b, c, d, e)
+#else
+#define TRACE2(name, a, b)                                                    \
+  do {                                                                        \
+  } while (0)
+#define TRACE3(name, a, b, c)                                                 \
+  do {                                                                        \
+  } while (0)
+#define TRACE4(name, a, b, c, d)                                              \
+  do {                                                                        \
+  } while (0)
+#define TRACE5(name, a, b, c, d, e)                                           \
+  do {                                                                        \
+  } while (0)
+#endif
+
+#endif /* HAVE_TRACE_H */
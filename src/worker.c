@@ -0,0 +1,253 @@
+/**
+ * worker.c: Network worker thread.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#include <curl/curl.h>
+
+#include "http.h"
+#include "misc.h"
+#include "worker.h"
+
+/**
+ * Slots per ring, a power of two. It also bounds the number of outstanding
+ * jobs, so that results always fit into the way back.
+ */
+#define RING_SIZE 256
+
+/**
+ * A lock-free single-producer, single-consumer ring of jobs. Only the
+ * producer moves tail and only the consumer moves head, the atomic
+ * accesses order the slot contents against the index updates.
+ */
+typedef struct {
+  worker_job *slots[RING_SIZE];
+  gint head;
+  gint tail;
+} worker_ring;
+
+/**
+ * A source that dispatches whenever its ring has jobs in it
+ */
+typedef struct {
+  GSource source;
+  worker_ring *ring;
+} ring_source;
+
+static gboolean ring_push(worker_ring *ring, worker_job *job);
+static worker_job *ring_pop(worker_ring *ring);
+static gboolean ring_empty(worker_ring *ring);
+static GSource *ring_source_new(worker_ring *ring, GSourceFunc func);
+static gboolean ring_source_prepare(GSource *source, gint *timeout);
+static gboolean ring_source_check(GSource *source);
+static gboolean ring_source_dispatch(GSource *source, GSourceFunc callback,
+                                     gpointer data);
+static gboolean run_jobs(gpointer data);
+static gboolean finish_jobs(gpointer data);
+static gpointer worker_thread(gpointer data);
+
+static GSourceFuncs ring_source_funcs = {
+    ring_source_prepare, ring_source_check, ring_source_dispatch, NULL, NULL,
+    NULL};
+
+/**
+ * Worker thread state
+ */
+static struct {
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+  /* main thread -> worker thread */
+  worker_ring jobs;
+  /* worker thread -> main thread */
+  worker_ring results;
+  GSource *jobs_source;
+  GSource *results_source;
+  /* jobs pushed but not yet back, main thread only */
+  guint outstanding;
+} worker;
+
+gboolean worker_init(void) {
+  // not thread-safe, so before the thread exists
+  if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+    return FALSE;
+
+  worker.context = g_main_context_new();
+  if (!http_init(worker.context)) {
+    g_main_context_unref(worker.context);
+    worker.context = NULL;
+    curl_global_cleanup();
+    return FALSE;
+  }
+  worker.loop = g_main_loop_new(worker.context, FALSE);
+
+  worker.jobs_source = ring_source_new(&worker.jobs, run_jobs);
+  g_source_attach(worker.jobs_source, worker.context);
+  worker.results_source = ring_source_new(&worker.results, finish_jobs);
+  g_source_attach(worker.results_source, NULL);
+
+  worker.thread = g_thread_new("worker", worker_thread, NULL);
+  return TRUE;
+}
+
+void worker_cleanup(void) {
+  worker_job *job;
+
+  if (!worker.thread)
+    return;
+
+  g_main_loop_quit(worker.loop);
+  g_thread_join(worker.thread);
+  worker.thread = NULL;
+
+  // jobs the worker never picked up are dropped, finished and aborted
+  // ones still go to their owners
+  while ((job = ring_pop(&worker.jobs)))
+    job->destroy(job);
+  finish_jobs(NULL);
+  worker.outstanding = 0;
+
+  g_source_destroy(worker.results_source);
+  g_source_unref(worker.results_source);
+  g_source_destroy(worker.jobs_source);
+  g_source_unref(worker.jobs_source);
+  g_main_loop_unref(worker.loop);
+  g_main_context_unref(worker.context);
+  worker.loop = NULL;
+  worker.context = NULL;
+  curl_global_cleanup();
+}
+
+gboolean worker_push(worker_job *job) {
+  if (!worker.thread || worker.outstanding >= RING_SIZE ||
+      !ring_push(&worker.jobs, job))
+    return FALSE;
+
+  worker.outstanding++;
+  g_main_context_wakeup(worker.context);
+  return TRUE;
+}
+
+void worker_job_done(worker_job *job) {
+  // can't fail, there are never more than RING_SIZE jobs outstanding
+  ring_push(&worker.results, job);
+  g_main_context_wakeup(NULL);
+}
+
+/**
+ * Run the worker's main loop until #worker_cleanup stops it, then abort
+ * the requests that are still running
+ */
+static gpointer worker_thread(G_GNUC_UNUSED gpointer data) {
+  g_main_context_push_thread_default(worker.context);
+  g_main_loop_run(worker.loop);
+  http_cleanup();
+  g_main_context_pop_thread_default(worker.context);
+  return NULL;
+}
+
+/**
+ * Start all jobs waiting for the worker, on the worker thread
+ */
+static gboolean run_jobs(G_GNUC_UNUSED gpointer data) {
+  worker_job *job;
+
+  while ((job = ring_pop(&worker.jobs)))
+    job->run(job);
+  return TRUE;
+}
+
+/**
+ * Hand finished jobs to their owners, on the main thread
+ */
+static gboolean finish_jobs(G_GNUC_UNUSED gpointer data) {
+  worker_job *job;
+
+  count_wakeup(WAKEUP_WORKER);
+  while ((job = ring_pop(&worker.results))) {
+    worker.outstanding--;
+    job->done(job);
+  }
+  return TRUE;
+}
+
+/**
+ * Add a job to the ring, returns FALSE if it is full. Producer only.
+ */
+static gboolean ring_push(worker_ring *ring, worker_job *job) {
+  guint tail = g_atomic_int_get(&ring->tail);
+
+  if (tail - (guint)g_atomic_int_get(&ring->head) == RING_SIZE)
+    return FALSE;
+
+  ring->slots[tail & (RING_SIZE - 1)] = job;
+  // publish the slot before the new tail
+  g_atomic_int_set(&ring->tail, tail + 1);
+  return TRUE;
+}
+
+/**
+ * Take the oldest job from the ring, NULL if it is empty. Consumer only.
+ */
+static worker_job *ring_pop(worker_ring *ring) {
+  guint head = g_atomic_int_get(&ring->head);
+  worker_job *job;
+
+  if (head == (guint)g_atomic_int_get(&ring->tail))
+    return NULL;
+
+  job = ring->slots[head & (RING_SIZE - 1)];
+  // the producer may reuse the slot once head has moved on
+  g_atomic_int_set(&ring->head, head + 1);
+  return job;
+}
+
+static gboolean ring_empty(worker_ring *ring) {
+  return g_atomic_int_get(&ring->head) == g_atomic_int_get(&ring->tail);
+}
+
+/**
+ * Create a source that calls func whenever ring has jobs in it. Producers
+ * wake the consumer's context up after pushing.
+ */
+static GSource *ring_source_new(worker_ring *ring, GSourceFunc func) {
+  GSource *source = g_source_new(&ring_source_funcs, sizeof(ring_source));
+
+  ((ring_source *)source)->ring = ring;
+  g_source_set_callback(source, func, NULL, NULL);
+  return source;
+}
+
+static gboolean ring_source_prepare(GSource *source, gint *timeout) {
+  *timeout = -1;
+  return !ring_empty(((ring_source *)source)->ring);
+}
+
+static gboolean ring_source_check(GSource *source) {
+  return !ring_empty(((ring_source *)source)->ring);
+}
+
+static gboolean ring_source_dispatch(G_GNUC_UNUSED GSource *source,
+                                     GSourceFunc callback, gpointer data) {
+  return callback(data);
+}
@@ -0,0 +1,70 @@
+/**
+ * worker.h: Network worker thread.
+ *
+ * ==================================================================
+ * Copyright (c) 2009-2013 Christoph Mende <mende.christoph@gmail.com>
+ * Based on Jonathan Coome's work on scmpc
+ *
+ * This file is part of scmpc.
+ *
+ * scmpc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * scmpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with scmpc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ==================================================================
+ */
+
+#ifndef HAVE_WORKER_H
+#define HAVE_WORKER_H
+
+#include <glib.h>
+
+/**
+ * A unit of work for the worker thread. Jobs are embedded at the start of
+ * a larger record that carries everything the work needs, the main thread
+ * doesn't touch the record while it is on the worker thread.
+ */
+typedef struct worker_job worker_job;
+
+struct worker_job {
+  /* runs on the worker thread, must end with #worker_job_done */
+  void (*run)(worker_job *job);
+  /* runs on the main thread once the job is done */
+  void (*done)(worker_job *job);
+  /* releases a job the worker never started, at shutdown */
+  void (*destroy)(worker_job *job);
+};
+
+/**
+ * Start the worker thread and set up the HTTP engine in its main context
+ */
+gboolean worker_init(void);
+
+/**
+ * Stop the worker thread, aborting running requests. Finished and aborted
+ * jobs are still handed to their owners, jobs that never started are
+ * destroyed.
+ */
+void worker_cleanup(void);
+
+/**
+ * Hand a job to the worker thread. Returns FALSE without taking the job if
+ * too many jobs are outstanding or the worker is stopped. Main thread only.
+ */
+gboolean worker_push(worker_job *job);
+
+/**
+ * Hand a finished job back to the main thread. Worker thread only.
+ */
+void worker_job_done(worker_job *job);
+
+#endif /* HAVE_WORKER_H */